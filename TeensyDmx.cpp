@@ -1,6 +1,7 @@
 #include "TeensyDmx.h"
 #include "rdm.h"
 #include <limits>
+#include <avr/eeprom.h>
 
 namespace {
 
@@ -10,6 +11,10 @@ constexpr uint32_t BREAKFORMAT = SERIAL_8E1;
 constexpr uint32_t DMXSPEED = 250000;
 constexpr uint32_t DMXFORMAT = SERIAL_8N2;
 constexpr uint16_t NACK_WAS_ACK = 0xffff;  // Send an ACK, not a NACK
+constexpr uint16_t UID_STORE_MAGIC = 0x5444;  // "TD"
+// Slots sent in each DMX frame, a small buffer is padded out with zeroes
+constexpr uint16_t DMX_TX_SLOTS = (static_cast<uint16_t>(DMX_BUFFER_SIZE) < DMX_MIN_TX_SLOTS) ?
+                                  static_cast<uint16_t>(DMX_MIN_TX_SLOTS) : DMX_BUFFER_SIZE;
 
 // RDM discovery debugging
 // Enable: sed -i -e 's/Serial\./\/\/ Serial./g' TeensyDmx.{cpp,h}
@@ -189,6 +194,81 @@ inline void putUInt48(void* const buffer, const uint64_t value)
 
 }  // anon namespace
 
+// The shared interrupt handlers for each UART, defined further down
+void UART0RxStatus();
+void UART0RxError();
+void UART0TxStatus();
+void UART1RxStatus();
+void UART1RxError();
+void UART1TxStatus();
+void UART2RxStatus();
+void UART2RxError();
+void UART2TxStatus();
+#ifdef HAS_KINETISK_UART3
+void UART3RxStatus();
+void UART3RxError();
+void UART3TxStatus();
+#endif
+#ifdef HAS_KINETISK_UART4
+void UART4RxStatus();
+void UART4RxError();
+void UART4TxStatus();
+#endif
+#ifdef HAS_KINETISK_UART5
+void UART5RxStatus();
+void UART5RxError();
+void UART5TxStatus();
+#endif
+
+#if TEENSYDMX_RDM_CONTROLLER
+uint16_t RdmUidSet::lowerBound(const byte *uid) const
+{
+    uint16_t low = 0;
+    uint16_t high = m_count;
+    while (low < high) {
+        uint16_t mid = (low + high) / 2;
+        if (memcmp(get(mid), uid, RDM_UID_LENGTH) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+bool RdmUidSet::contains(const byte *uid) const
+{
+    uint16_t index = lowerBound(uid);
+    return (index < m_count) && (memcmp(get(index), uid, RDM_UID_LENGTH) == 0);
+}
+
+RdmUidSet::Result RdmUidSet::insert(const byte *uid)
+{
+    uint16_t index = lowerBound(uid);
+    if ((index < m_count) && (memcmp(get(index), uid, RDM_UID_LENGTH) == 0)) {
+        return UID_DUPLICATE;
+    }
+    if (full()) {
+        return UID_FULL;
+    }
+    byte *position = &m_uids[index * RDM_UID_LENGTH];
+    memmove(position + RDM_UID_LENGTH, position, (m_count - index) * RDM_UID_LENGTH);
+    memcpy(position, uid, RDM_UID_LENGTH);
+    ++m_count;
+    return UID_ADDED;
+}
+
+void RdmUidSet::remove(uint16_t index)
+{
+    if (index >= m_count) {
+        return;
+    }
+    byte *position = &m_uids[index * RDM_UID_LENGTH];
+    memmove(position, position + RDM_UID_LENGTH, (m_count - index - 1) * RDM_UID_LENGTH);
+    --m_count;
+}
+#endif
+
 TeensyDmx::TeensyDmx(HardwareSerial& uart, RdmInit* rdm, uint8_t redePin) :
     TeensyDmx(uart, rdm)
 {
@@ -198,64 +278,155 @@ TeensyDmx::TeensyDmx(HardwareSerial& uart, RdmInit* rdm, uint8_t redePin) :
 }
 
 TeensyDmx::TeensyDmx(HardwareSerial& uart, RdmInit* rdm) :
+    m_isrs(),
     m_uart(uart),
-    m_dmxBuffer1{0},
-    m_dmxBuffer2{0},
-    m_activeBuffer(m_dmxBuffer1),
-    m_inactiveBuffer(m_dmxBuffer2),
-    m_dmxBufferIndex(0),
-    m_frameCount(0),
+#if TEENSYDMX_RDM
     m_shortMessage(0),
     m_checksumFail(0),
     m_lengthMismatch(0),
-    m_newFrame(false),
+    m_rdm(rdm),
+    m_rdmNeedsProcessing(false),
+    m_rdmBuffer(),
+    m_rdmChecksum(0),
+    m_rdmRunningChecksum(0),
+#endif
+#if TEENSYDMX_RDM_RESPONDER
     m_rdmChange(false),
+    m_rxWindowFollowsRdm(false),
+    m_rdmMute(false),
+    m_identifyMode(false),
+    m_deviceLabel{0},
+#endif
+#if TEENSYDMX_RDM_CONTROLLER
     m_rdmResponseDue(0),
-    m_mode(DMX_OFF),
-    m_state(State::IDLE),
+    m_rdmTimeoutMargin(RDM_DEFAULT_TIMEOUT_MARGIN),
+    m_rdmResponseStarted(false),
+    m_rdmTransmitting(false),
+    m_rdmTransmitPending(false),
+    m_dmxPaused(false),
+    m_dmxFramesSent(0),
+    m_rdmMinDmxFrames(RDM_DEFAULT_MIN_DMX_FRAMES),
+    m_rdmTxChecksum(0),
     m_discoveryState(DiscoveryState::DISCOVERY_IDLE),
-    m_nextDiscoveryAction(0),
+    m_discoveryStart(0),
+    m_discoveryStats(),
+    m_rdmRequestEnd(0),
+    m_rdmNextRequestAllowed(0),
     m_dubQueue{0},
     m_dubPointer(0),
     m_dubLowerBoundUid(RDM_MIN_LOWER_BOUND_UID),
     m_dubUpperBoundUid(RDM_MAX_UPPER_BOUND_UID),
-    m_uidList{0},
-    m_uidCount(0),
+    m_uids(),
+    m_lastFoundUid{0},
+    m_uidOverflow(false),
+    m_uidTableChanged(false),
+    m_uidVersion(0),
+    m_uidStorageAddress(-1),
+    m_wiredOrDecoding(false),
+    m_dubDecodingActive(false),
+    m_dubPruned(false),
+    m_mutePending(false),
+    m_verifyIndex(0),
+    m_verifyPending(false),
+    m_verifyAttempts(0),
+    m_discoveryInterval(0),
+    m_lastDiscoveryEnd(0),
+    m_dubResponseComplete(false),
     m_controllerState(ControllerState::CONTROLLER_IDLE),
+    m_requestQueue(),
+    m_requestHead(0),
+    m_requestCount(0),
+    m_requestInFlight(false),
+    m_queueTurn(false),
+    m_transactionNumber(0),
+    m_lastTransactionNumber(0),
+    m_deferredRequests(),
+    m_deferredInFlight(-1),
+    m_rdmCache(),
+    m_rdmCacheTtls(),
+    m_rdmCacheTtlCount(0),
+    m_rdmCacheHits(0),
+    m_rdmCacheMisses(0),
+    m_rdmMaxRetries(RDM_DEFAULT_RETRIES),
+    m_rdmRetryBackoff(RDM_DEFAULT_RETRY_BACKOFF),
+    m_rdmRetryDue(0),
+    m_deviceStats(),
+    m_deviceStatsCount(0),
+    m_statsUid(),
+    m_statsPending(false),
+    m_rdmResponseEnd(0),
+    m_latencyPending(false),
+    m_latencyStats(),
+#endif
+    m_dmxBuffer1{0},
+    m_dmxBuffer2{0},
+    m_activeBuffer(m_dmxBuffer1),
+    m_inactiveBuffer(m_dmxBuffer2),
+    m_dmxBufferIndex(0),
+    m_frameCount(0),
+    m_newFrame(false),
+    m_mode(DMX_OFF),
+    m_state(State::IDLE),
     m_redePin(nullptr),
-    m_rdmMute(false),
-    m_identifyMode(false),
-    m_rdm(rdm),
-    m_rdmNeedsProcessing(false),
-    m_rdmBuffer(),
-    m_rdmChecksum(0),
-    m_deviceLabel{0}
+    m_uartModem(nullptr),
+    m_rtsConfig(nullptr),
+    m_rtsHandoverPending(false),
+    m_rxWindowStart(0),
+    m_rxWindowEnd(DMX_BUFFER_SIZE)
 {
+#if !TEENSYDMX_RDM
+    (void)rdm;
+#endif
     // Serial.begin(9600);
     // Serial.println("Started TeensyDmx");
 
     if (&m_uart == &Serial1) {
         uartInstances[0] = this;
+        m_isrs.rxStatus = UART0RxStatus;
+        m_isrs.rxError = UART0RxError;
+        m_isrs.txStatus = UART0TxStatus;
     } else if (&m_uart == &Serial2) {
         uartInstances[1] = this;
+        m_isrs.rxStatus = UART1RxStatus;
+        m_isrs.rxError = UART1RxError;
+        m_isrs.txStatus = UART1TxStatus;
     } else if (&m_uart == &Serial3) {
         uartInstances[2] = this;
+        m_isrs.rxStatus = UART2RxStatus;
+        m_isrs.rxError = UART2RxError;
+        m_isrs.txStatus = UART2TxStatus;
     }
 #ifdef HAS_KINETISK_UART3
     else if (&m_uart == &Serial4) {
         uartInstances[3] = this;
+        m_isrs.rxStatus = UART3RxStatus;
+        m_isrs.rxError = UART3RxError;
+        m_isrs.txStatus = UART3TxStatus;
     }
 #endif
 #ifdef HAS_KINETISK_UART4
     else if (&m_uart == &Serial5) {
         uartInstances[4] = this;
+        m_isrs.rxStatus = UART4RxStatus;
+        m_isrs.rxError = UART4RxError;
+        m_isrs.txStatus = UART4TxStatus;
     }
 #endif
 #ifdef HAS_KINETISK_UART5
     else if (&m_uart == &Serial6) {
         uartInstances[5] = this;
+        m_isrs.rxStatus = UART5RxStatus;
+        m_isrs.rxError = UART5RxError;
+        m_isrs.txStatus = UART5TxStatus;
     }
 #endif
+
+#ifdef TEENSYDMX_PROFILING
+    // Make sure the cycle counter is running
+    ARM_DEMCR |= ARM_DEMCR_TRCENA;
+    ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+    clearProfileStats();
+#endif
 }
 
 const volatile uint8_t* TeensyDmx::getBuffer() const
@@ -270,13 +441,68 @@ const volatile uint8_t* TeensyDmx::getBuffer() const
 
 uint8_t TeensyDmx::getChannel(const uint16_t address)
 {
-    if (address < DMX_BUFFER_SIZE) {
-        return getBuffer()[address];
-    } else {
-        return 0;
+    if (m_mode != DMX_IN) {
+        if (address < DMX_BUFFER_SIZE) {
+            return getBuffer()[address];
+        }
+    } else if (address >= m_rxWindowStart && address < m_rxWindowEnd) {
+        return getBuffer()[address - m_rxWindowStart];
+    }
+    return 0;
+}
+
+void TeensyDmx::setReceiveWindow(uint16_t startAddress, uint16_t length)
+{
+#if TEENSYDMX_RDM_RESPONDER
+    m_rxWindowFollowsRdm = false;
+#endif
+    if (startAddress >= DMX_UNIVERSE_SIZE) {
+        startAddress = DMX_UNIVERSE_SIZE;
+        length = 0;
+    }
+    if (length > DMX_BUFFER_SIZE) {
+        length = DMX_BUFFER_SIZE;
+    }
+    if (length > DMX_UNIVERSE_SIZE - startAddress) {
+        length = DMX_UNIVERSE_SIZE - startAddress;
+    }
+    __disable_irq();
+    m_rxWindowStart = startAddress;
+    m_rxWindowEnd = startAddress + length;
+    if (m_mode == DMX_IN) {
+        // Drop the frame in progress, it's been stored at the old offsets
+        m_state = State::IDLE;
+    }
+    __enable_irq();
+    if (m_mode == DMX_IN) {
+        // Don't show slots from the old window as the new one, the ISR
+        // leaves the buffers alone until the next break
+        for (uint16_t i = 0; i < DMX_BUFFER_SIZE; ++i) {
+            m_dmxBuffer1[i] = 0;
+            m_dmxBuffer2[i] = 0;
+        }
+    }
+}
+
+void TeensyDmx::clearReceiveWindow()
+{
+    setReceiveWindow(0, DMX_BUFFER_SIZE);
+}
+
+#if TEENSYDMX_RDM_RESPONDER
+void TeensyDmx::setReceiveWindowToFootprint()
+{
+    if (m_rdm == nullptr) {
+        clearReceiveWindow();
+        return;
     }
+    // The start address is 1-512
+    setReceiveWindow(m_rdm->startAddress - 1, m_rdm->footprint);
+    m_rxWindowFollowsRdm = true;
 }
+#endif
 
+#if TEENSYDMX_RDM_RESPONDER
 bool TeensyDmx::isIdentify() const
 {
     return m_identifyMode;
@@ -286,7 +512,9 @@ const char* TeensyDmx::getLabel() const
 {
     return m_deviceLabel;
 }
+#endif
 
+#if TEENSYDMX_RDM
 const volatile uint16_t TeensyDmx::getShortMessage() const
 {
     return m_shortMessage;
@@ -301,11 +529,16 @@ const volatile uint16_t TeensyDmx::getLengthMismatch() const
 {
     return m_lengthMismatch;
 }
+#endif
 
 void TeensyDmx::setMode(TeensyDmx::Mode mode)
 {
     // Stop what we were doing
     m_state = IDLE;
+#if TEENSYDMX_RDM_CONTROLLER
+    m_rdmTransmitPending = false;
+    m_dmxPaused = false;
+#endif
 
     switch (m_mode)
     {
@@ -373,125 +606,178 @@ void TeensyDmx::nextTx()
         m_dmxBufferIndex = 0;
     } else if (m_state == State::DMX_TX) {
         // Check if we're at the end of the packet
-        if (m_dmxBufferIndex == DMX_BUFFER_SIZE) {
+        if (m_dmxBufferIndex == DMX_TX_SLOTS) {
+#if TEENSYDMX_RDM_CONTROLLER
+            if (m_dmxFramesSent < 0xff) {
+                ++m_dmxFramesSent;
+            }
+            if (m_rdmTransmitPending && m_dmxFramesSent >= m_rdmMinDmxFrames) {
+                // Use the gap for the waiting request instead of the next frame
+                m_rdmTransmitPending = false;
+                m_dmxPaused = true;
+                m_state = State::RDM_TX_BREAK;
+                m_uart.begin(RDM_BREAKSPEED, BREAKFORMAT);
+                m_uart.write(0);
+                return;
+            }
+#endif
             m_state = State::BREAK;
             // Send BREAK
             m_uart.begin(BREAKSPEED, BREAKFORMAT);
             m_uart.write(0);
-        } else {
+        } else if (m_dmxBufferIndex < DMX_BUFFER_SIZE) {
             m_uart.write(m_activeBuffer[m_dmxBufferIndex]);
             ++m_dmxBufferIndex;
+        } else {
+            m_uart.write(0);
+            ++m_dmxBufferIndex;
+        }
+    }
+#if TEENSYDMX_RDM_CONTROLLER
+    else if (m_state == State::RDM_TX_BREAK) {
+        m_state = State::RDM_TX;
+        m_uart.begin(DMXSPEED, DMXFORMAT);
+        m_uart.write(reinterpret_cast<uint8_t*>(&m_rdmBuffer)[0]);
+        m_dmxBufferIndex = 1;
+    } else if (m_state == State::RDM_TX) {
+        if (m_dmxBufferIndex < m_rdmBuffer.length) {
+            m_uart.write(reinterpret_cast<uint8_t*>(&m_rdmBuffer)[m_dmxBufferIndex]);
+        } else if (m_dmxBufferIndex == m_rdmBuffer.length) {
+            m_uart.write(m_rdmTxChecksum >> 8);
+        } else if (m_dmxBufferIndex == (m_rdmBuffer.length + 1)) {
+            m_uart.write(m_rdmTxChecksum & 0xff);
+            m_rtsHandoverPending = (m_rtsConfig != nullptr);
+        } else {
+            // Last byte has gone, turn the line around for the response
+            finishRDMTransmit();
+            return;
         }
+        ++m_dmxBufferIndex;
     }
+#endif
 }
 
 
-void uart0_status_isr();  // Back reference to serial1.c
 void UART0TxStatus()
 {
+    TeensyDmx::ProfileScope profile(uartInstances[0], PROFILE_TX_STATUS);
     if ((UART0_S1 & UART_S1_TC)) {
         // TX complete
         uartInstances[0]->nextTx();
     }
     // Call standard ISR too
     uart0_status_isr();
+    uartInstances[0]->maybeHandOverDirection(UART0_S1);
 }
 
-void uart1_status_isr();  // Back reference to serial2.c
 void UART1TxStatus()
 {
+    TeensyDmx::ProfileScope profile(uartInstances[1], PROFILE_TX_STATUS);
     if ((UART1_S1 & UART_S1_TC)) {
         // TX complete
         uartInstances[1]->nextTx();
     }
     // Call standard ISR too
     uart1_status_isr();
+    uartInstances[1]->maybeHandOverDirection(UART1_S1);
 }
 
-void uart2_status_isr();  // Back reference to serial3.c
 void UART2TxStatus()
 {
+    TeensyDmx::ProfileScope profile(uartInstances[2], PROFILE_TX_STATUS);
     if ((UART2_S1 & UART_S1_TC)) {
         // TX complete
         uartInstances[2]->nextTx();
     }
     // Call standard ISR too
     uart2_status_isr();
+    uartInstances[2]->maybeHandOverDirection(UART2_S1);
 }
 
 #ifdef HAS_KINETISK_UART3
-void uart3_status_isr();  // Back reference to serial4.c
 void UART3TxStatus()
 {
+    TeensyDmx::ProfileScope profile(uartInstances[3], PROFILE_TX_STATUS);
     if ((UART3_S1 & UART_S1_TC)) {
         // TX complete
         uartInstances[3]->nextTx();
     }
     // Call standard ISR too
     uart3_status_isr();
+    uartInstances[3]->maybeHandOverDirection(UART3_S1);
 }
 #endif
 
 #ifdef HAS_KINETISK_UART4
-void uart4_status_isr();  // Back reference to serial5.c
 void UART4TxStatus()
 {
+    TeensyDmx::ProfileScope profile(uartInstances[4], PROFILE_TX_STATUS);
     if ((UART4_S1 & UART_S1_TC)) {
         // TX complete
         uartInstances[4]->nextTx();
     }
     // Call standard ISR too
     uart4_status_isr();
+    uartInstances[4]->maybeHandOverDirection(UART4_S1);
 }
 #endif
 
 #ifdef HAS_KINETISK_UART5
-void uart5_status_isr();  // Back reference to serial6.c
 void UART5TxStatus()
 {
+    TeensyDmx::ProfileScope profile(uartInstances[5], PROFILE_TX_STATUS);
     if ((UART5_S1 & UART_S1_TC)) {
         // TX complete
         uartInstances[5]->nextTx();
     }
     // Call standard ISR too
     uart5_status_isr();
+    uartInstances[5]->maybeHandOverDirection(UART5_S1);
 }
 #endif
 
-void TeensyDmx::startTransmit()
+void TeensyDmx::attachTxInterrupt()
 {
-    setDirection(true);
-
-    m_dmxBufferIndex = 0;
-
     if (&m_uart == &Serial1) {
         // Change interrupt vector to mine to monitor TX complete
-        attachInterruptVector(IRQ_UART0_STATUS, UART0TxStatus);
+        attachInterruptVector(IRQ_UART0_STATUS, m_isrs.txStatus);
     } else if (&m_uart == &Serial2) {
         // Change interrupt vector to mine to monitor TX complete
-        attachInterruptVector(IRQ_UART1_STATUS, UART1TxStatus);
+        attachInterruptVector(IRQ_UART1_STATUS, m_isrs.txStatus);
     } else if (&m_uart == &Serial3) {
         // Change interrupt vector to mine to monitor TX complete
-        attachInterruptVector(IRQ_UART2_STATUS, UART2TxStatus);
+        attachInterruptVector(IRQ_UART2_STATUS, m_isrs.txStatus);
     }
 #ifdef HAS_KINETISK_UART3
     else if (&m_uart == &Serial4) {
         // Change interrupt vector to mine to monitor TX complete
-        attachInterruptVector(IRQ_UART3_STATUS, UART3TxStatus);
+        attachInterruptVector(IRQ_UART3_STATUS, m_isrs.txStatus);
     }
 #endif
 #ifdef HAS_KINETISK_UART4
     else if (&m_uart == &Serial5) {
         // Change interrupt vector to mine to monitor TX complete
-        attachInterruptVector(IRQ_UART4_STATUS, UART4TxStatus);
+        attachInterruptVector(IRQ_UART4_STATUS, m_isrs.txStatus);
     }
 #endif
 #ifdef HAS_KINETISK_UART5
     else if (&m_uart == &Serial6) {
         // Change interrupt vector to mine to monitor TX complete
-        attachInterruptVector(IRQ_UART5_STATUS, UART5TxStatus);
+        attachInterruptVector(IRQ_UART5_STATUS, m_isrs.txStatus);
     }
 #endif
+}
+
+void TeensyDmx::startTransmit()
+{
+    setDirection(true);
+
+    m_dmxBufferIndex = 0;
+#if TEENSYDMX_RDM_CONTROLLER
+    m_dmxFramesSent = 0;
+#endif
+
+    attachTxInterrupt();
 
     // Send BREAK
     m_state = State::BREAK;
@@ -535,15 +821,20 @@ bool TeensyDmx::newFrame(void)
     return newFrame;
 }
 
+#if TEENSYDMX_RDM_RESPONDER
 bool TeensyDmx::rdmChanged(void)
 {
     bool rdmChange = m_rdmChange;
     m_rdmChange = false;
     return rdmChange;
 }
+#endif
 
 void TeensyDmx::completeFrame()
 {
+#if TEENSYDMX_RDM_CONTROLLER
+    noteRDMResponseStart();
+#endif
     switch (m_state)
     {
         case State::DMX_RECV:
@@ -559,6 +850,7 @@ void TeensyDmx::completeFrame()
             }
             m_newFrame = true;
             break;
+#if TEENSYDMX_RDM
         case State::RDM_RECV:
         case State::RDM_RECV_CHECKSUM_HI:
             // Double check the previous partial message was an RDM one
@@ -573,6 +865,7 @@ void TeensyDmx::completeFrame()
                 }
             }
             // Fall through
+#endif
         default:
             // Unknown, ASC? frame or was RDM packet
             break;
@@ -580,6 +873,7 @@ void TeensyDmx::completeFrame()
     m_state = State::BREAK;
 }
 
+#if TEENSYDMX_RDM_RESPONDER
 void TeensyDmx::rdmDiscUniqueBranch()
 {
     if (m_rdm == nullptr || m_rdmMute) {
@@ -712,7 +1006,7 @@ uint16_t TeensyDmx::rdmSetDMXStartAddress()
         return E120_NR_FORMAT_ERROR;
     }
     uint16_t newStartAddress = getUInt16(m_rdmBuffer.data);
-    if ((newStartAddress <= 0) || (newStartAddress > DMX_BUFFER_SIZE)) {
+    if ((newStartAddress <= 0) || (newStartAddress > DMX_UNIVERSE_SIZE)) {
         // Out of range start address
         return E120_NR_DATA_OUT_OF_RANGE;
     }
@@ -720,6 +1014,9 @@ uint16_t TeensyDmx::rdmSetDMXStartAddress()
         return E120_NR_HARDWARE_FAULT;
     }
     m_rdm->startAddress = newStartAddress;
+    if (m_rxWindowFollowsRdm) {
+        setReceiveWindowToFootprint();
+    }
     m_rdmBuffer.dataLength = 0;
     m_rdmChange = true;
     return NACK_WAS_ACK;
@@ -913,7 +1210,9 @@ uint16_t TeensyDmx::rdmGetSupportedParameters()
         return NACK_WAS_ACK;
     }
 }
+#endif
 
+#if TEENSYDMX_RDM
 uint16_t TeensyDmx::rdmCalculateChecksum(uint8_t* data, uint8_t length)
 {
     uint16_t checksum = 0;
@@ -997,24 +1296,316 @@ void TeensyDmx::maybeIncrementChecksumFail()
           }
     }
 }
+#endif
 
 
+#if TEENSYDMX_RDM_CONTROLLER
 void TeensyDmx::doRDMDiscovery() {
-    m_uidCount = 0;
+    m_uids.clear();
+    m_uidTableChanged = true;
+    ++m_uidVersion;
+    startRDMDiscovery();
+}
+
+void TeensyDmx::doRDMIncrementalDiscovery() {
+    // Same as a full discovery, but keeping the table for verification
+    startRDMDiscovery();
+}
+
+void TeensyDmx::doRDMWarmStartDiscovery() {
+    if ((m_uidStorageAddress >= 0) && loadRDMUids(m_uidStorageAddress) &&
+            (m_uids.count() > 0)) {
+        if (m_rdm != nullptr && m_rdm->discoveryCallback != nullptr) {
+            m_rdm->discoveryCallback(CallbackStatus::CB_RDM_CACHED, m_uids.data(),
+                                     m_uids.count());
+        }
+    } else {
+        m_uids.clear();
+    }
+    doRDMIncrementalDiscovery();
+}
+
+void TeensyDmx::setRDMUidStorage(int address)
+{
+    m_uidStorageAddress = address;
+}
+
+// Stored as magic, count, the packed UIDs, then a sum of all the UID bytes
+bool TeensyDmx::saveRDMUids(int address)
+{
+    uint16_t header[2] = {UID_STORE_MAGIC, m_uids.count()};
+    uint16_t length = m_uids.count() * RDM_UID_LENGTH;
+    if ((address < 0) ||
+            ((address + sizeof(header) + length + sizeof(uint16_t)) > (E2END + 1))) {
+        return false;
+    }
+    uint16_t checksum = 0;
+    for (uint16_t i = 0; i < length; ++i) {
+        checksum += m_uids.data()[i];
+    }
+    byte *eeprom = reinterpret_cast<byte*>(address);
+    eeprom_write_block(header, eeprom, sizeof(header));
+    eeprom_write_block(m_uids.data(), eeprom + sizeof(header), length);
+    eeprom_write_block(&checksum, eeprom + sizeof(header) + length, sizeof(checksum));
+    return true;
+}
+
+bool TeensyDmx::loadRDMUids(int address)
+{
+    uint16_t header[2];
+    if ((address < 0) || ((address + sizeof(header)) > (E2END + 1))) {
+        return false;
+    }
+    const byte *eeprom = reinterpret_cast<const byte*>(address);
+    eeprom_read_block(header, eeprom, sizeof(header));
+    uint16_t length = header[1] * RDM_UID_LENGTH;
+    if ((header[0] != UID_STORE_MAGIC) || (header[1] > RdmUidSet::CAPACITY) ||
+            ((address + sizeof(header) + length + sizeof(uint16_t)) > (E2END + 1))) {
+        return false;
+    }
+    // Check the whole image before touching the table, so a corrupt one
+    // leaves the UIDs we already have alone. It's read twice rather than
+    // into a copy of the table, which could be too big for the stack.
+    uint16_t checksum = 0;
+    for (uint16_t i = 0; i < length; ++i) {
+        byte value;
+        eeprom_read_block(&value, eeprom + sizeof(header) + i, sizeof(value));
+        checksum += value;
+    }
+    uint16_t storedChecksum;
+    eeprom_read_block(&storedChecksum, eeprom + sizeof(header) + length, sizeof(storedChecksum));
+    if (checksum != storedChecksum) {
+        return false;
+    }
+    m_uids.clear();
+    for (uint16_t i = 0; i < header[1]; ++i) {
+        byte uid[RDM_UID_LENGTH];
+        eeprom_read_block(uid, eeprom + sizeof(header) + (i * RDM_UID_LENGTH),
+                          RDM_UID_LENGTH);
+        m_uids.insert(uid);
+    }
+    m_uidTableChanged = false;
+    ++m_uidVersion;
+    return true;
+}
+
+void TeensyDmx::setRDMDiscoveryInterval(uint32_t interval)
+{
+    m_discoveryInterval = interval;
+}
+
+void TeensyDmx::maybeStartIncrementalDiscovery()
+{
+    if ((m_discoveryInterval == 0) ||
+            (m_discoveryState != DiscoveryState::DISCOVERY_IDLE)) {
+        return;
+    }
+    if ((millis() - m_lastDiscoveryEnd) >= m_discoveryInterval) {
+        doRDMIncrementalDiscovery();
+    }
+}
+
+void TeensyDmx::startRDMDiscovery() {
+    // Any UIDs still in the table get verified before we DUB
+    m_verifyIndex = 0;
+    m_verifyPending = false;
+    m_verifyAttempts = 0;
+    m_uidOverflow = false;
+    m_dubDecodingActive = m_wiredOrDecoding;
+    m_dubPruned = false;
+    m_mutePending = false;
     m_dubPointer = 0;
     m_discoveryState = DiscoveryState::DISCOVERY_UN_MUTE;
-    // Action queued, do it ASAP
-    m_nextDiscoveryAction = 0;
+    m_discoveryStart = micros();
+    m_discoveryStats = RdmDiscoveryStats();
     m_dubLowerBoundUid = RDM_MIN_LOWER_BOUND_UID;
     m_dubUpperBoundUid = RDM_MAX_UPPER_BOUND_UID;
-    m_dubQueue[(m_dubPointer * 2)] = m_dubLowerBoundUid;
-    m_dubQueue[(m_dubPointer * 2) + 1] = m_dubUpperBoundUid;
+    pushDubRange(m_dubLowerBoundUid, m_dubUpperBoundUid);
+}
+
+void TeensyDmx::pushDubRange(uint64_t lower, uint64_t upper)
+{
+    if (m_dubPointer >= MAX_DUB_QUEUE) {
+        // Can't happen given the depth of a binary search over 48 bits, but
+        // never write past the end of the stack
+        return;
+    }
+    m_dubQueue[(m_dubPointer * 2)] = lower;
+    m_dubQueue[(m_dubPointer * 2) + 1] = upper;
     m_dubPointer++;
 }
 
+void TeensyDmx::setRDMWiredOrDecoding(bool enabled)
+{
+    m_wiredOrDecoding = enabled;
+}
+
+void TeensyDmx::setRDMTimeoutMargin(uint32_t margin)
+{
+    m_rdmTimeoutMargin = margin;
+}
+
+void TeensyDmx::setRDMMinDmxFrames(uint8_t frames)
+{
+    m_rdmMinDmxFrames = (frames > 0) ? frames : 1;
+}
+#endif
+
+bool TeensyDmx::useHardwareDirection(uint8_t rtsPin)
+{
+#ifdef KINETISK
+    // The pins each UART's RTS comes out on, as the ALT3 function, on all
+    // the Teensy 3.x boards
+    volatile uint8_t *modem = nullptr;
+    if (&m_uart == &Serial1) {
+        if (rtsPin == 6 || rtsPin == 19) {
+            modem = &UART0_MODEM;
+        }
+    } else if (&m_uart == &Serial2) {
+        if (rtsPin == 22) {
+            modem = &UART1_MODEM;
+        }
+    } else if (&m_uart == &Serial3) {
+        if (rtsPin == 2) {
+            modem = &UART2_MODEM;
+        }
+    }
+    if (modem == nullptr) {
+        return false;
+    }
+    // Until the end of a request the pin is a plain output like the RE/DE
+    // pin, see setDirection()
+    *modem &= ~UART_MODEM_TXRTSE;
+    pinMode(rtsPin, OUTPUT);
+    m_uartModem = modem;
+    m_rtsConfig = portConfigRegister(rtsPin);
+    m_redePin = portOutputRegister(rtsPin);
+    setDirection(false);
+    return true;
+#else
+    (void)rtsPin;
+    return false;
+#endif
+}
+
+#if TEENSYDMX_RDM_CONTROLLER
+const RdmResponderLatencyStats& TeensyDmx::getRDMResponderLatencyStats() const
+{
+    return m_latencyStats;
+}
+
+void TeensyDmx::clearRDMResponderLatencyStats()
+{
+    memset(&m_latencyStats, 0, sizeof(m_latencyStats));
+}
+#endif
+
+bool TeensyDmx::getProfileStats(ProfileSite site, ProfileStats& stats) const
+{
+#ifdef TEENSYDMX_PROFILING
+    if (site >= PROFILE_SITE_COUNT) {
+        return false;
+    }
+    // The interrupt sites can change under us
+    __disable_irq();
+    stats = m_profile[site];
+    __enable_irq();
+    return true;
+#else
+    (void)site;
+    (void)stats;
+    return false;
+#endif
+}
+
+void TeensyDmx::clearProfileStats()
+{
+#ifdef TEENSYDMX_PROFILING
+    __disable_irq();
+    memset(m_profile, 0, sizeof(m_profile));
+    for (uint8_t i = 0; i < PROFILE_SITE_COUNT; ++i) {
+        m_profile[i].min = std::numeric_limits<uint32_t>::max();
+    }
+    __enable_irq();
+#endif
+}
+
+#ifdef TEENSYDMX_PROFILING
+void TeensyDmx::recordProfile(ProfileSite site, uint32_t cycles)
+{
+    ProfileStats& stats = m_profile[site];
+    ++stats.count;
+    stats.total += cycles;
+    if (cycles < stats.min) {
+        stats.min = cycles;
+    }
+    if (cycles > stats.max) {
+        stats.max = cycles;
+    }
+    uint8_t bucket = (cycles == 0) ? 0 : (31 - __builtin_clz(cycles));
+    if (bucket >= PROFILE_HISTOGRAM_BUCKETS) {
+        bucket = PROFILE_HISTOGRAM_BUCKETS - 1;
+    }
+    ++stats.histogram[bucket];
+}
+#endif
+
+#if TEENSYDMX_RDM_CONTROLLER
+// Called from the RX interrupts when the first sign of a response arrives
+void TeensyDmx::noteRDMResponseStart()
+{
+    if (!m_latencyPending) {
+        return;
+    }
+    m_latencyPending = false;
+    uint32_t latency = micros() - m_rdmRequestEnd;
+    RdmResponderLatencyStats& stats = m_latencyStats;
+    stats.last = latency;
+    if (stats.count == 0 || latency < stats.min) {
+        stats.min = latency;
+    }
+    if (latency > stats.max) {
+        stats.max = latency;
+    }
+    ++stats.count;
+}
+
+void TeensyDmx::maybeResumeDmx()
+{
+    if (!m_dmxPaused || m_rdmTransmitting ||
+            m_controllerState != ControllerState::CONTROLLER_IDLE) {
+        return;
+    }
+    // The response window has closed, take the line back
+    m_dmxPaused = false;
+    stopReceive();
+    startTransmit();
+}
+
 void TeensyDmx::maybeTimeoutRDMMessage() {
+    if (m_rdmNeedsProcessing || m_rdmTransmitting) {
+        // Already got something to process, deal with that first, or the
+        // response window hasn't started yet
+        return;
+    }
     if (m_controllerState != ControllerState::CONTROLLER_IDLE) {
-        if (millis() >= m_rdmResponseDue) {
+        // Signed difference copes with micros() wrapping
+        if (static_cast<int32_t>(micros() - m_rdmResponseDue) >= 0) {
+            if (!m_rdmResponseStarted) {
+                // If a response has started within the window, give it
+                // long enough to complete rather than cutting it off
+                if (m_controllerState == ControllerState::RDM_DUB &&
+                        m_state != State::RDM_DUB_PRE_PREAMBLE) {
+                    m_rdmResponseStarted = true;
+                    m_rdmResponseDue += RDM_MAX_DUB_RESPONSE_DURATION;
+                    return;
+                } else if (m_controllerState == ControllerState::RDM_MESSAGE &&
+                        m_state != State::IDLE) {
+                    m_rdmResponseStarted = true;
+                    m_rdmResponseDue += RDM_MAX_RESPONSE_DURATION;
+                    return;
+                }
+            }
             switch (m_controllerState)
             {
                 case ControllerState::RDM_DUB:
@@ -1025,8 +1616,6 @@ void TeensyDmx::maybeTimeoutRDMMessage() {
                       // A timed out DUB with no data becomes a timeout
                       // Serial.print("DUB timing out, RDM: ");
                       // Serial.print(m_rdmResponseDue);
-                      // Serial.print(", Disc: ");
-                      // Serial.print(m_nextDiscoveryAction);
                       // Serial.print(", millis: ");
                       // Serial.println(millis());
                       m_controllerState = ControllerState::RDM_DUB_TIMEOUT;
@@ -1054,449 +1643,1038 @@ void TeensyDmx::maybeTimeoutRDMMessage() {
 }
 
 
-void TeensyDmx::maybeProgressRDMDiscovery() {
-    if (m_discoveryState != DiscoveryState::DISCOVERY_IDLE) {
-        if (millis() >= m_nextDiscoveryAction) {
-            switch (m_discoveryState)
-            {
-                case DiscoveryState::DISCOVERY_MUTE:
-                    if (m_uidCount > 0) {
-                      // Mute the last UID discovered
-                      sendRDMDiscMute(&m_uidList[((m_uidCount - 1) * RDM_UID_LENGTH)]);
-                    }
-                    m_discoveryState = DiscoveryState::DISCOVERY_DUB;
-                    m_nextDiscoveryAction = millis() + DISCOVERY_ACTION_OFFSET;
-                    break;
-                case DiscoveryState::DISCOVERY_UN_MUTE:
-                    sendRDMDiscUnMute(RDM_BROADCAST_UID);
-                    m_discoveryState = DiscoveryState::DISCOVERY_DUB;
-                    m_nextDiscoveryAction = millis() + DISCOVERY_ACTION_OFFSET;
-                    break;
-                case DiscoveryState::DISCOVERY_DUB:
-                    if (m_dubPointer > 0) {
-                        m_dubLowerBoundUid = m_dubQueue[((m_dubPointer - 1) * 2)];
-                        m_dubUpperBoundUid = m_dubQueue[((m_dubPointer - 1) * 2) + 1];
-                        sendRDMDiscUniqueBranch(m_dubLowerBoundUid, m_dubUpperBoundUid);
-                        // Remove the item from the queue
-                        m_dubPointer--;
-                        // Serial.print("DUB pointer now ");
-                        // Serial.println(m_dubPointer);
-                        m_nextDiscoveryAction = millis() + DUB_ACTION_OFFSET;
-                    }
-                    break;
-                default:
-                    // Serial.print("Unhandled disc state ");
-                    // Serial.println(m_discoveryState);
-                    // Do nothing
-                    break;
-            }
-        }
-    }
+const RdmDiscoveryStats& TeensyDmx::getRDMDiscoveryStats() const
+{
+    return m_discoveryStats;
 }
 
+bool TeensyDmx::canSendRDMRequest() const
+{
+    // No outstanding transaction and we've left the E1.20 packet spacing
+    return m_controllerState == ControllerState::CONTROLLER_IDLE &&
+        static_cast<int32_t>(micros() - m_rdmNextRequestAllowed) >= 0;
+}
 
-void TeensyDmx::sendRDMDiscMute(byte *uid) {
-    m_rdmBuffer.dataLength = 0;
-
-    // Serial.print("Mute to ");
-    for(int j = 0; j < RDM_UID_LENGTH; j++)
+void TeensyDmx::maybeProgressRDMDiscovery() {
+    // Each step is sent as soon as the previous one's response window has
+    // finished, rather than on a fixed timer
+    if (m_discoveryState == DiscoveryState::DISCOVERY_IDLE || !canSendRDMRequest()) {
+        return;
+    }
+    switch (m_discoveryState)
     {
-      // Serial.print(uid[j], HEX);
-      if ((j + 1) < RDM_UID_LENGTH) {
-          // Don't print a colon after the last byte
-          // Serial.print(":");
-      }
+        case DiscoveryState::DISCOVERY_MUTE:
+            m_discoveryState = DiscoveryState::DISCOVERY_DUB;
+            // Mute the last UID discovered
+            m_mutePending = true;
+            sendDiscoveryRequest(m_lastFoundUid, E120_DISC_MUTE, nullptr, 0);
+            break;
+        case DiscoveryState::DISCOVERY_UN_MUTE:
+            m_discoveryState = DiscoveryState::DISCOVERY_VERIFY;
+            sendDiscoveryRequest(RDM_BROADCAST_UID, E120_DISC_UN_MUTE, nullptr, 0);
+            break;
+        case DiscoveryState::DISCOVERY_VERIFY:
+            if (m_verifyIndex < m_uids.count()) {
+                // A known device which answers our mute is still there, and
+                // won't then answer the DUBs
+                m_verifyPending = true;
+                sendDiscoveryRequest(m_uids.get(m_verifyIndex), E120_DISC_MUTE, nullptr, 0);
+            } else {
+                // Everything known is muted, look for anything new
+                m_discoveryState = DiscoveryState::DISCOVERY_DUB;
+            }
+            break;
+        case DiscoveryState::DISCOVERY_DUB:
+            if (m_dubPointer > 0) {
+                m_dubLowerBoundUid = m_dubQueue[((m_dubPointer - 1) * 2)];
+                m_dubUpperBoundUid = m_dubQueue[((m_dubPointer - 1) * 2) + 1];
+                DiscUniqueBranchRequest dub_request;
+                putUInt48(&dub_request.lowerBoundUID, m_dubLowerBoundUid);
+                putUInt48(&dub_request.upperBoundUID, m_dubUpperBoundUid);
+                // Remove the item from the queue
+                m_dubPointer--;
+                // Serial.print("DUB pointer now ");
+                // Serial.println(m_dubPointer);
+                ++m_discoveryStats.dubCount;
+                sendDiscoveryRequest(RDM_BROADCAST_UID, E120_DISC_UNIQUE_BRANCH,
+                                     reinterpret_cast<byte*>(&dub_request),
+                                     sizeof(dub_request));
+            } else {
+                completeRDMDiscovery();
+            }
+            break;
+        default:
+            // Serial.print("Unhandled disc state ");
+            // Serial.println(m_discoveryState);
+            // Do nothing
+            break;
+    }
+    if (m_controllerState != ControllerState::CONTROLLER_IDLE) {
+        // We sent something, let the queue have the next go
+        m_queueTurn = true;
     }
-    // Serial.println("");
-
-    buildSendRDMMessage(uid, E120_DISCOVERY_COMMAND, E120_DISC_MUTE);
 }
 
 
-void TeensyDmx::sendRDMDiscUnMute(byte *uid) {
-    m_rdmBuffer.dataLength = 0;
+bool TeensyDmx::queueRDMRequest(
+        const byte *uid,
+        uint8_t commandClass,
+        uint16_t pid,
+        const byte *data,
+        uint8_t dataLength,
+        RdmRequestCallback callback,
+        void *context,
+        uint32_t tag,
+        uint16_t subDevice)
+{
+    if (m_rdm == nullptr) {
+        // We need our own UID to be a controller
+        return false;
+    }
+    if (m_requestCount >= MAX_RDM_REQUEST_QUEUE) {
+        // Queue full, the caller can try again later
+        return false;
+    }
+    if (dataLength > RDM_MAX_REQUEST_DATA_LENGTH) {
+        return false;
+    }
 
-    buildSendRDMMessage(uid, E120_DISCOVERY_COMMAND, E120_DISC_UN_MUTE);
+    RdmRequest& request =
+        m_requestQueue[(m_requestHead + m_requestCount) % MAX_RDM_REQUEST_QUEUE];
+    fillRDMRequest(request, uid, commandClass, pid, data, dataLength);
+    request.subDev = subDevice;
+    request.callback = callback;
+    request.context = context;
+    request.tag = tag;
+    ++m_requestCount;
+    return true;
 }
 
-
-void TeensyDmx::sendRDMDiscUniqueBranch(uint64_t lower_uid, uint64_t upper_uid) {
-    DiscUniqueBranchRequest *dub_request =
-        reinterpret_cast<DiscUniqueBranchRequest*>(m_rdmBuffer.data);
-
-    putUInt48(&dub_request->lowerBoundUID, lower_uid);
-    putUInt48(&dub_request->upperBoundUID, upper_uid);
-
-    sendRDMDiscUniqueBranch();
+uint8_t TeensyDmx::getRDMQueueLength() const
+{
+    return m_requestCount;
 }
 
+const RdmUidSet& TeensyDmx::getRDMUids() const
+{
+    return m_uids;
+}
 
-void TeensyDmx::sendRDMDiscUniqueBranch(byte *lower_uid, byte *upper_uid) {
-    DiscUniqueBranchRequest *dub_request =
-        reinterpret_cast<DiscUniqueBranchRequest*>(m_rdmBuffer.data);
-
-    memcpy(dub_request->lowerBoundUID, lower_uid, RDM_UID_LENGTH);
-    memcpy(dub_request->upperBoundUID, upper_uid, RDM_UID_LENGTH);
+uint16_t TeensyDmx::getRDMUidVersion() const
+{
+    return m_uidVersion;
+}
 
-    sendRDMDiscUniqueBranch();
+bool TeensyDmx::isRDMIdle() const
+{
+    for (uint8_t i = 0; i < MAX_RDM_DEFERRED_REQUESTS; ++i) {
+        if (m_deferredRequests[i].used) {
+            return false;
+        }
+    }
+    return m_controllerState == ControllerState::CONTROLLER_IDLE &&
+        m_requestCount == 0 &&
+        m_discoveryState == DiscoveryState::DISCOVERY_IDLE;
 }
 
+void TeensyDmx::fillRDMRequest(
+        RdmRequest& request,
+        const byte *uid,
+        uint8_t commandClass,
+        uint16_t pid,
+        const byte *data,
+        uint8_t dataLength)
+{
+    memcpy(request.destId, uid, RDM_UID_LENGTH);
+    request.subDev = RDM_ROOT_DEVICE;
+    request.cmdClass = commandClass;
+    request.pid = pid;
+    request.dataLength = dataLength;
+    if (dataLength > 0) {
+        memcpy(request.data, data, dataLength);
+    }
+    request.callback = nullptr;
+    request.context = nullptr;
+    request.tag = 0;
+    request.attempts = 0;
+}
 
-// Ensure you've set the parameters if using this directly
-void TeensyDmx::sendRDMDiscUniqueBranch() {
-    /*
-    DiscUniqueBranchRequest *dub_request =
-        reinterpret_cast<DiscUniqueBranchRequest*>(m_rdmBuffer.data);
+void TeensyDmx::maybeSendQueuedRDMRequest()
+{
+    if (m_controllerState != ControllerState::CONTROLLER_IDLE || maybeSendDeferredRDMRequest() ||
+            m_requestCount == 0 || m_requestInFlight) {
+        return;
+    }
+    RdmRequest& request = m_requestQueue[m_requestHead];
+    if (request.attempts > 0) {
+        // A retry waits out its backoff, then goes straight to the bus
+        if (static_cast<int32_t>(millis() - m_rdmRetryDue) < 0 || !canSendRDMRequest()) {
+            return;
+        }
+    } else {
+        // A cache hit doesn't touch the bus, so doesn't need to wait for it
+        if (maybeAnswerFromCache() || !canSendRDMRequest()) {
+            return;
+        }
+        if (isRDMCacheable(request)) {
+            ++m_rdmCacheMisses;
+        }
+        invalidateRDMCache(request);
+    }
+    // The request stays at the head of the queue until it completes so the
+    // response can be matched against it
+    m_requestInFlight = true;
+    m_queueTurn = false;
+    sendRDMRequest(request);
+}
 
-    // Serial.print("DUB from ");
-    for(int j = 0; j < RDM_UID_LENGTH; j++)
-    {
-      // Serial.print(dub_request->lowerBoundUID[j], HEX);
-      if ((j + 1) < RDM_UID_LENGTH) {
-          // Don't print a colon after the last byte
-          // Serial.print(":");
-      }
+bool TeensyDmx::isRDMRetryable(const RdmRequest& request)
+{
+    if (isForMany(request.destId)) {
+        // Nothing comes back to tell us it failed
+        return false;
     }
-    // Serial.print(" to ");
-    for(int j = 0; j < RDM_UID_LENGTH; j++)
+    if (request.cmdClass == E120_GET_COMMAND) {
+        return true;
+    }
+    if (request.cmdClass != E120_SET_COMMAND) {
+        return false;
+    }
+    // SETs to an absolute value end up the same however many times they
+    // arrive, unlike resets, self tests or sensor recording
+    switch (request.pid)
     {
-      // Serial.print(dub_request->upperBoundUID[j], HEX);
-      if ((j + 1) < RDM_UID_LENGTH) {
-          // Don't print a colon after the last byte
-          // Serial.print(":");
-      }
+        case E120_DEVICE_LABEL:
+        case E120_DMX_PERSONALITY:
+        case E120_DMX_START_ADDRESS:
+        case E120_LANGUAGE:
+        case E120_IDENTIFY_DEVICE:
+        case E120_PAN_INVERT:
+        case E120_TILT_INVERT:
+        case E120_PAN_TILT_SWAP:
+        case E120_LAMP_STATE:
+        case E120_LAMP_ON_MODE:
+        case E120_DISPLAY_INVERT:
+        case E120_DISPLAY_LEVEL:
+        case E137_1_POWER_ON_SELF_TEST:
+            return true;
+        default:
+            return false;
     }
-    // Serial.println("");
-    */
+}
 
-    m_rdmBuffer.dataLength = sizeof(DiscUniqueBranchRequest);
+bool TeensyDmx::maybeRetryRDMRequest(RdmRequest& request, CallbackStatus status)
+{
+    if ((status != CallbackStatus::CB_RDM_TIMEOUT &&
+            status != CallbackStatus::CB_RDM_CHECKSUM_ERROR) ||
+            request.attempts >= m_rdmMaxRetries || !isRDMRetryable(request)) {
+        return false;
+    }
+    ++request.attempts;
+    uint8_t shift = (request.attempts < 8) ? (request.attempts - 1) : 7;
+    m_rdmRetryDue = millis() + (m_rdmRetryBackoff << shift);
+    RdmDeviceStats *stats = getRDMDeviceStatsEntry(request.destId);
+    if (stats != nullptr) {
+        ++stats->retries;
+    }
+    return true;
+}
 
-    buildSendRDMMessage(RDM_BROADCAST_UID, E120_DISCOVERY_COMMAND, E120_DISC_UNIQUE_BRANCH);
-    m_state = State::RDM_DUB_PRE_PREAMBLE;
-    m_controllerState = ControllerState::RDM_DUB;
-    m_rdmResponseDue = millis() + RDM_DUB_TIMEOUT_DURATION;
-    // Serial.print("DUB started, RDM ");
-    // Serial.print(m_rdmResponseDue);
-    // Serial.print(", Disc: ");
-    // Serial.print(m_nextDiscoveryAction);
-    // Serial.print(", millis: ");
-    // Serial.println(millis());
+void TeensyDmx::setRDMRetries(uint8_t retries, uint32_t backoff)
+{
+    m_rdmMaxRetries = retries;
+    m_rdmRetryBackoff = backoff;
 }
 
+uint8_t TeensyDmx::getRDMDeviceStatsCount() const
+{
+    return m_deviceStatsCount;
+}
 
-void TeensyDmx::sendRDMGetDeviceInfo(byte *uid) {
-    m_rdmBuffer.dataLength = 0;
+const RdmDeviceStats* TeensyDmx::getRDMDeviceStats(uint8_t index) const
+{
+    if (index >= m_deviceStatsCount) {
+        return nullptr;
+    }
+    return &m_deviceStats[index];
+}
 
-    buildSendRDMMessage(uid, E120_GET_COMMAND, E120_DEVICE_INFO);
+const RdmDeviceStats* TeensyDmx::findRDMDeviceStats(const byte *uid) const
+{
+    for (uint8_t i = 0; i < m_deviceStatsCount; ++i) {
+        if (memcmp(m_deviceStats[i].uid, uid, RDM_UID_LENGTH) == 0) {
+            return &m_deviceStats[i];
+        }
+    }
+    return nullptr;
 }
 
+void TeensyDmx::clearRDMDeviceStats()
+{
+    m_deviceStatsCount = 0;
+}
 
-void TeensyDmx::sendRDMGetManufacturerLabel(byte *uid) {
-    m_rdmBuffer.dataLength = 0;
+RdmDeviceStats* TeensyDmx::getRDMDeviceStatsEntry(const byte *uid)
+{
+    RdmDeviceStats *stats = const_cast<RdmDeviceStats*>(findRDMDeviceStats(uid));
+    if (stats != nullptr) {
+        return stats;
+    }
+    if (m_deviceStatsCount < TEENSYDMX_MAX_RDM_DEVICE_STATS) {
+        stats = &m_deviceStats[m_deviceStatsCount++];
+    } else {
+        // Full, forget whichever device we've talked to least recently
+        stats = &m_deviceStats[0];
+        for (uint8_t i = 1; i < m_deviceStatsCount; ++i) {
+            if (static_cast<int32_t>(m_deviceStats[i].lastUsed - stats->lastUsed) < 0) {
+                stats = &m_deviceStats[i];
+            }
+        }
+    }
+    memset(stats, 0, sizeof(*stats));
+    memcpy(stats->uid, uid, RDM_UID_LENGTH);
+    stats->lastUsed = millis();
+    return stats;
+}
 
-    buildSendRDMMessage(uid, E120_GET_COMMAND, E120_MANUFACTURER_LABEL);
+void TeensyDmx::recordRDMDeviceStats(CallbackStatus status)
+{
+    if (!m_statsPending) {
+        // Discovery, broadcasts and cache hits don't count
+        return;
+    }
+    m_statsPending = false;
+    RdmDeviceStats *stats = getRDMDeviceStatsEntry(m_statsUid);
+    switch (status)
+    {
+        case CallbackStatus::CB_SUCCESS:
+            {
+                uint32_t latency = m_rdmResponseEnd - m_rdmRequestEnd;
+                ++stats->responses;
+                stats->totalLatency += latency;
+                if (latency > stats->maxLatency) {
+                    stats->maxLatency = latency;
+                }
+            }
+            break;
+        case CallbackStatus::CB_RDM_TIMEOUT:
+            ++stats->timeouts;
+            break;
+        case CallbackStatus::CB_RDM_CHECKSUM_ERROR:
+            ++stats->checksumErrors;
+            break;
+        default:
+            break;
+    }
 }
 
+bool TeensyDmx::deferRDMRequest(const RdmRequest& request, uint32_t delay)
+{
+    for (uint8_t i = 0; i < MAX_RDM_DEFERRED_REQUESTS; ++i) {
+        RdmDeferredRequest& deferred = m_deferredRequests[i];
+        if (!deferred.used) {
+            deferred.request = request;
+            deferred.due = millis() + delay;
+            deferred.attempts = 0;
+            deferred.drain = false;
+            deferred.used = true;
+            return true;
+        }
+    }
+    // No room, the caller gets the ACK_TIMER and can follow it up itself
+    return false;
+}
 
-void TeensyDmx::sendRDMGetDeviceLabel(byte *uid) {
-    m_rdmBuffer.dataLength = 0;
+void TeensyDmx::scheduleRDMQueuedMessageDrain(const byte *uid)
+{
+    uint8_t freeSlot = MAX_RDM_DEFERRED_REQUESTS;
+    for (uint8_t i = 0; i < MAX_RDM_DEFERRED_REQUESTS; ++i) {
+        RdmDeferredRequest& deferred = m_deferredRequests[i];
+        if (!deferred.used) {
+            if (freeSlot == MAX_RDM_DEFERRED_REQUESTS) {
+                freeSlot = i;
+            }
+        } else if (memcmp(deferred.request.destId, uid, RDM_UID_LENGTH) == 0) {
+            // Already fetching from this device, which will drain it anyway
+            return;
+        }
+    }
+    if (freeSlot == MAX_RDM_DEFERRED_REQUESTS) {
+        return;
+    }
+    RdmDeferredRequest& deferred = m_deferredRequests[freeSlot];
+    fillRDMRequest(deferred.request, uid, E120_GET_COMMAND, E120_QUEUED_MESSAGE, nullptr, 0);
+    deferred.due = millis();
+    deferred.attempts = 0;
+    deferred.drain = true;
+    deferred.used = true;
+}
 
-    buildSendRDMMessage(uid, E120_GET_COMMAND, E120_DEVICE_LABEL);
+bool TeensyDmx::maybeSendDeferredRDMRequest()
+{
+    if (m_requestInFlight || !canSendRDMRequest()) {
+        return false;
+    }
+    uint32_t now = millis();
+    for (uint8_t i = 0; i < MAX_RDM_DEFERRED_REQUESTS; ++i) {
+        RdmDeferredRequest& deferred = m_deferredRequests[i];
+        if (deferred.used && static_cast<int32_t>(now - deferred.due) >= 0) {
+            // Only ask for error status messages alongside the queued one
+            byte statusType = E120_STATUS_ERROR;
+            RdmRequest followUp;
+            fillRDMRequest(followUp, deferred.request.destId, E120_GET_COMMAND,
+                           E120_QUEUED_MESSAGE, &statusType, sizeof(statusType));
+            m_deferredInFlight = i;
+            m_queueTurn = false;
+            sendRDMRequest(followUp);
+            return true;
+        }
+    }
+    return false;
 }
 
+void TeensyDmx::processDeferredResponse(CallbackStatus status, RdmData *data)
+{
+    RdmDeferredRequest& deferred = m_deferredRequests[m_deferredInFlight];
+    m_deferredInFlight = -1;
+    if (status != CallbackStatus::CB_SUCCESS || data == nullptr) {
+        retryDeferredRDMRequest(deferred, status, RDM_FOLLOW_UP_RETRY_DELAY);
+        return;
+    }
+    uint16_t pid = swapUInt16(data->parameter);
+    if (data->responseType == E120_RESPONSE_TYPE_ACK_TIMER) {
+        // Still not ready
+        retryDeferredRDMRequest(deferred, CallbackStatus::CB_RDM_TIMEOUT,
+                                RdmResponse(data).getAckTimerDelay());
+    } else if (data->responseType == E120_RESPONSE_TYPE_NACK_REASON &&
+               pid == E120_QUEUED_MESSAGE) {
+        // The device won't give us queued messages, so asking again won't
+        // help. The NACK is for QUEUED_MESSAGE rather than what was asked
+        // for, so the original request fails as if it never answered
+        if (deferred.drain) {
+            deferred.used = false;
+        } else {
+            finishDeferredRDMRequest(deferred, CallbackStatus::CB_RDM_TIMEOUT, nullptr);
+        }
+    } else if (pid == E120_STATUS_MESSAGES && data->dataLength == 0) {
+        // Nothing queued. Error status messages come back with this PID too,
+        // those are passed on below like any other queued message
+        if (deferred.drain) {
+            deferred.used = false;
+        } else {
+            retryDeferredRDMRequest(deferred, CallbackStatus::CB_RDM_TIMEOUT,
+                                    RDM_FOLLOW_UP_RETRY_DELAY);
+        }
+    } else if (!deferred.drain && pid == deferred.request.pid &&
+               data->cmdClass == (deferred.request.cmdClass + 1)) {
+        // The response we were waiting for, ACK or NACK
+        uint8_t messageCount = data->messageCount;
+        byte uid[RDM_UID_LENGTH];
+        memcpy(uid, data->sourceId, RDM_UID_LENGTH);
+        finishDeferredRDMRequest(deferred, CallbackStatus::CB_SUCCESS, data);
+        if (messageCount > 0) {
+            scheduleRDMQueuedMessageDrain(uid);
+        }
+    } else {
+        // Some other queued message, pass it on and keep going
+        if (m_rdm != nullptr && m_rdm->controllerCallback != nullptr) {
+            m_rdm->controllerCallback(CallbackStatus::CB_SUCCESS, data);
+        }
+        if (deferred.drain && data->messageCount == 0) {
+            deferred.used = false;
+        } else {
+            retryDeferredRDMRequest(deferred, CallbackStatus::CB_RDM_TIMEOUT, 0);
+        }
+    }
+}
 
-void TeensyDmx::sendRDMGetDeviceModelDescription(byte *uid) {
-    m_rdmBuffer.dataLength = 0;
+void TeensyDmx::retryDeferredRDMRequest(RdmDeferredRequest& deferred, CallbackStatus status,
+                                        uint32_t delay)
+{
+    if (++deferred.attempts >= MAX_RDM_FOLLOW_UP_ATTEMPTS) {
+        // Give up, telling whoever sent the original request
+        finishDeferredRDMRequest(deferred, status, nullptr);
+        return;
+    }
+    deferred.due = millis() + delay;
+}
 
-    buildSendRDMMessage(uid, E120_GET_COMMAND, E120_DEVICE_MODEL_DESCRIPTION);
+void TeensyDmx::finishDeferredRDMRequest(RdmDeferredRequest& deferred, CallbackStatus status,
+                                         RdmData *data)
+{
+    // Free the slot first so the callback can queue more
+    deferred.used = false;
+    if (deferred.drain) {
+        return;
+    }
+    if (deferred.request.callback != nullptr) {
+        deferred.request.callback(status, RdmResponse(data), deferred.request.context,
+                                  deferred.request.tag);
+    } else if (m_rdm != nullptr && m_rdm->controllerCallback != nullptr) {
+        m_rdm->controllerCallback(status, data);
+    }
 }
 
+bool TeensyDmx::setRDMCacheTTL(uint16_t pid, uint32_t ttl)
+{
+    for (uint8_t i = 0; i < m_rdmCacheTtlCount; ++i) {
+        if (m_rdmCacheTtls[i].pid == pid) {
+            m_rdmCacheTtls[i].ttl = ttl;
+            return true;
+        }
+    }
+    if (m_rdmCacheTtlCount >= MAX_RDM_CACHE_TTL_OVERRIDES) {
+        return false;
+    }
+    m_rdmCacheTtls[m_rdmCacheTtlCount].pid = pid;
+    m_rdmCacheTtls[m_rdmCacheTtlCount].ttl = ttl;
+    ++m_rdmCacheTtlCount;
+    return true;
+}
 
-void TeensyDmx::sendRDMGetIdentifyDevice(byte *uid) {
-    m_rdmBuffer.dataLength = 0;
+void TeensyDmx::clearRDMCache()
+{
+    for (uint8_t i = 0; i < TEENSYDMX_RDM_CACHE_SIZE; ++i) {
+        m_rdmCache[i].used = false;
+    }
+}
 
-    buildSendRDMMessage(uid, E120_GET_COMMAND, E120_IDENTIFY_DEVICE);
+uint32_t TeensyDmx::getRDMCacheHits() const
+{
+    return m_rdmCacheHits;
 }
 
+uint32_t TeensyDmx::getRDMCacheMisses() const
+{
+    return m_rdmCacheMisses;
+}
 
-void TeensyDmx::sendRDMSetIdentifyDevice(byte *uid, bool identify_state) {
-    if (identify_state) {
-        m_rdmBuffer.data[0] = 1;
-    } else {
-        m_rdmBuffer.data[0] = 0;
+uint32_t TeensyDmx::getRDMCacheTTL(uint16_t pid) const
+{
+    for (uint8_t i = 0; i < m_rdmCacheTtlCount; ++i) {
+        if (m_rdmCacheTtls[i].pid == pid) {
+            return m_rdmCacheTtls[i].ttl;
+        }
     }
-    m_rdmBuffer.dataLength = 1;
+    switch (pid)
+    {
+        case E120_DEVICE_INFO:
+        case E120_SUPPORTED_PARAMETERS:
+        case E120_MANUFACTURER_LABEL:
+        case E120_DEVICE_MODEL_DESCRIPTION:
+        case E120_SOFTWARE_VERSION_LABEL:
+        case E120_DEVICE_LABEL:
+        case E120_DMX_START_ADDRESS:
+        case E120_DMX_PERSONALITY:
+        case E120_DMX_PERSONALITY_DESCRIPTION:
+        case E120_SENSOR_DEFINITION:
+            return RDM_DEFAULT_CACHE_TTL;
+        default:
+            // Anything else, sensor values for instance, always goes to the device
+            return 0;
+    }
+}
 
-    buildSendRDMMessage(uid, E120_SET_COMMAND, E120_IDENTIFY_DEVICE);
+bool TeensyDmx::isRDMCacheable(const RdmRequest& request) const
+{
+    return request.cmdClass == E120_GET_COMMAND &&
+        request.dataLength <= RDM_MAX_CACHED_PARAM_LENGTH &&
+        getRDMCacheTTL(request.pid) != 0;
 }
 
+TeensyDmx::RdmCacheEntry* TeensyDmx::findRDMCacheEntry(const RdmRequest& request)
+{
+    for (uint8_t i = 0; i < TEENSYDMX_RDM_CACHE_SIZE; ++i) {
+        RdmCacheEntry& entry = m_rdmCache[i];
+        if (entry.used && entry.pid == request.pid && entry.subDev == request.subDev &&
+                entry.paramLength == request.dataLength &&
+                memcmp(entry.uid, request.destId, RDM_UID_LENGTH) == 0 &&
+                memcmp(entry.param, request.data, request.dataLength) == 0) {
+            return &entry;
+        }
+    }
+    return nullptr;
+}
 
-void TeensyDmx::sendRDMGetDmxStartAddress(byte *uid) {
-    m_rdmBuffer.dataLength = 0;
+bool TeensyDmx::maybeAnswerFromCache()
+{
+    const RdmRequest& request = m_requestQueue[m_requestHead];
+    if (!isRDMCacheable(request)) {
+        return false;
+    }
+    RdmCacheEntry *entry = findRDMCacheEntry(request);
+    if (entry == nullptr || static_cast<int32_t>(millis() - entry->expires) >= 0) {
+        return false;
+    }
+    ++m_rdmCacheHits;
+    // Fake up the response the device gave us last time
+    memcpy(m_rdmBuffer.sourceId, request.destId, RDM_UID_LENGTH);
+    memcpy(m_rdmBuffer.destId, m_rdm->uid, RDM_UID_LENGTH);
+    m_rdmBuffer.startCode = E120_SC_RDM;
+    m_rdmBuffer.subStartCode = E120_SC_SUB_MESSAGE;
+    m_rdmBuffer.responseType = E120_RESPONSE_TYPE_ACK;
+    m_rdmBuffer.messageCount = 0;
+    putUInt16(&m_rdmBuffer.subDev, request.subDev);
+    m_rdmBuffer.cmdClass = E120_GET_COMMAND_RESPONSE;
+    putUInt16(&m_rdmBuffer.parameter, request.pid);
+    m_rdmBuffer.dataLength = entry->dataLength;
+    memcpy(m_rdmBuffer.data, entry->data, entry->dataLength);
+    m_rdmBuffer.length = m_rdmBuffer.dataLength + RDM_PACKET_SIZE_NO_PD;
+    m_requestInFlight = true;
+    completeRDMRequest(CallbackStatus::CB_SUCCESS, &m_rdmBuffer);
+    return true;
+}
 
-    buildSendRDMMessage(uid, E120_GET_COMMAND, E120_DMX_START_ADDRESS);
+void TeensyDmx::storeRDMCacheEntry(const RdmRequest& request, const RdmData& response)
+{
+    if (!isRDMCacheable(request) ||
+            response.responseType != E120_RESPONSE_TYPE_ACK ||
+            response.dataLength > RDM_MAX_CACHED_DATA_LENGTH) {
+        return;
+    }
+    uint32_t ttl = getRDMCacheTTL(request.pid);
+    uint32_t now = millis();
+    RdmCacheEntry *entry = findRDMCacheEntry(request);
+    if (entry == nullptr) {
+        // Use a free or expired entry, or else the one closest to expiring
+        entry = &m_rdmCache[0];
+        for (uint8_t i = 0; i < TEENSYDMX_RDM_CACHE_SIZE; ++i) {
+            RdmCacheEntry& candidate = m_rdmCache[i];
+            if (!candidate.used || static_cast<int32_t>(now - candidate.expires) >= 0) {
+                entry = &candidate;
+                break;
+            }
+            if (static_cast<int32_t>(candidate.expires - entry->expires) < 0) {
+                entry = &candidate;
+            }
+        }
+    }
+    memcpy(entry->uid, request.destId, RDM_UID_LENGTH);
+    entry->subDev = request.subDev;
+    entry->pid = request.pid;
+    entry->paramLength = request.dataLength;
+    memcpy(entry->param, request.data, request.dataLength);
+    entry->dataLength = response.dataLength;
+    memcpy(entry->data, response.data, response.dataLength);
+    entry->expires = now + ttl;
+    entry->used = true;
 }
 
+void TeensyDmx::invalidateRDMCache(const RdmRequest& request)
+{
+    if (request.cmdClass != E120_SET_COMMAND) {
+        return;
+    }
+    bool broadcast = isForMany(request.destId);
+    for (uint8_t i = 0; i < TEENSYDMX_RDM_CACHE_SIZE; ++i) {
+        RdmCacheEntry& entry = m_rdmCache[i];
+        if (!entry.used) {
+            continue;
+        }
+        // Broadcasts and vendorcasts could have hit any device
+        if (!broadcast && (memcmp(entry.uid, request.destId, RDM_UID_LENGTH) != 0)) {
+            continue;
+        }
+        // DEVICE_INFO includes the start address and personality, so any
+        // SET might change it
+        if (entry.pid == request.pid || entry.pid == E120_DEVICE_INFO) {
+            entry.used = false;
+        }
+    }
+}
 
-void TeensyDmx::sendRDMSetDmxStartAddress(byte *uid, uint16_t dmx_address) {
-    if ((dmx_address > 0) && (dmx_address <= DMX_BUFFER_SIZE)) {
-        putUInt16(&m_rdmBuffer.data[0], dmx_address);
-        m_rdmBuffer.dataLength = 2;
+void TeensyDmx::completeRDMRequest(CallbackStatus status, RdmData *data)
+{
+    recordRDMDeviceStats(status);
+    if (m_deferredInFlight >= 0) {
+        processDeferredResponse(status, data);
+        return;
+    }
+    if (!m_requestInFlight) {
+        // Internal discovery message, nobody to tell
+        if (m_verifyPending) {
+            processVerifyResponse(status);
+        } else if (m_mutePending) {
+            processMuteResponse(status);
+        }
+        return;
+    }
+    // Take a copy of the callback and release the slot before calling it,
+    // so the callback is free to queue the next request
+    RdmRequest& request = m_requestQueue[m_requestHead];
+    if (maybeRetryRDMRequest(request, status)) {
+        // Stays at the head of the queue to go again after the backoff
+        m_requestInFlight = false;
+        return;
+    }
+    if (status == CallbackStatus::CB_SUCCESS && data != nullptr) {
+        if (data->messageCount > 0) {
+            scheduleRDMQueuedMessageDrain(data->sourceId);
+        }
+        if ((data->responseType == E120_RESPONSE_TYPE_ACK_TIMER) &&
+                deferRDMRequest(request, RdmResponse(data).getAckTimerDelay())) {
+            // The callback gets the real response once we've fetched it
+            m_requestHead = (m_requestHead + 1) % MAX_RDM_REQUEST_QUEUE;
+            --m_requestCount;
+            m_requestInFlight = false;
+            return;
+        }
+    }
+    RdmRequestCallback callback = request.callback;
+    void *context = request.context;
+    uint32_t tag = request.tag;
+    m_requestHead = (m_requestHead + 1) % MAX_RDM_REQUEST_QUEUE;
+    --m_requestCount;
+    m_requestInFlight = false;
+
+    if (callback != nullptr) {
+        callback(status, RdmResponse(data), context, tag);
+    } else if (m_rdm != nullptr && m_rdm->controllerCallback != nullptr) {
+        m_rdm->controllerCallback(status, data);
+    }
+}
 
-        buildSendRDMMessage(uid, E120_SET_COMMAND, E120_DMX_START_ADDRESS);
+bool TeensyDmx::isExpectedResponse() const
+{
+    if (!m_requestInFlight) {
+        // Discovery only sends mute and un-mute outside the queue, just check
+        // it's the response to the transaction we sent
+        return m_rdmBuffer.transNo == m_lastTransactionNumber;
     }
+    const RdmRequest& request = m_requestQueue[m_requestHead];
+    return m_rdmBuffer.transNo == m_lastTransactionNumber &&
+        m_rdmBuffer.cmdClass == (request.cmdClass + 1) &&
+        swapUInt16(m_rdmBuffer.parameter) == request.pid &&
+        memcmp(m_rdmBuffer.sourceId, request.destId, RDM_UID_LENGTH) == 0;
 }
 
 
-void TeensyDmx::sendRDMGetDmxPersonality(byte *uid) {
-    m_rdmBuffer.dataLength = 0;
+bool TeensyDmx::sendRDMDiscMute(byte *uid) {
+    // Serial.print("Mute to ");
+    for(int j = 0; j < RDM_UID_LENGTH; j++)
+    {
+      // Serial.print(uid[j], HEX);
+      if ((j + 1) < RDM_UID_LENGTH) {
+          // Don't print a colon after the last byte
+          // Serial.print(":");
+      }
+    }
+    // Serial.println("");
 
-    buildSendRDMMessage(uid, E120_GET_COMMAND, E120_DMX_PERSONALITY);
+    return queueRDMRequest(uid, E120_DISCOVERY_COMMAND, E120_DISC_MUTE, nullptr, 0);
 }
 
 
-void TeensyDmx::sendRDMSetDmxPersonality(byte *uid, uint8_t personality) {
-    if (personality >= 1) {
-        m_rdmBuffer.data[0] = personality;
-        m_rdmBuffer.dataLength = 1;
-
-        buildSendRDMMessage(uid, E120_SET_COMMAND, E120_DMX_PERSONALITY);
-    }
+bool TeensyDmx::sendRDMDiscUnMute(byte *uid) {
+    return queueRDMRequest(uid, E120_DISCOVERY_COMMAND, E120_DISC_UN_MUTE, nullptr, 0);
 }
 
 
-void TeensyDmx::sendRDMGetDmxPersonalityDescription(byte *uid, uint8_t personality) {
-    if (personality >= 1) {
-        m_rdmBuffer.data[0] = personality;
-        m_rdmBuffer.dataLength = 1;
+bool TeensyDmx::sendRDMDiscUniqueBranch(uint64_t lower_uid, uint64_t upper_uid) {
+    DiscUniqueBranchRequest dub_request;
 
-        buildSendRDMMessage(uid, E120_GET_COMMAND, E120_DMX_PERSONALITY_DESCRIPTION);
-    }
+    putUInt48(&dub_request.lowerBoundUID, lower_uid);
+    putUInt48(&dub_request.upperBoundUID, upper_uid);
+
+    return queueRDMRequest(RDM_BROADCAST_UID, E120_DISCOVERY_COMMAND,
+                           E120_DISC_UNIQUE_BRANCH,
+                           reinterpret_cast<byte*>(&dub_request),
+                           sizeof(dub_request));
 }
 
 
-void TeensyDmx::sendRDMSetResetDevice(byte *uid, uint8_t reset_mode) {
-    m_rdmBuffer.data[0] = reset_mode;
-    m_rdmBuffer.dataLength = 1;
+bool TeensyDmx::sendRDMDiscUniqueBranch(byte *lower_uid, byte *upper_uid) {
+    DiscUniqueBranchRequest dub_request;
 
-    buildSendRDMMessage(uid, E120_SET_COMMAND, E120_RESET_DEVICE);
+    memcpy(dub_request.lowerBoundUID, lower_uid, RDM_UID_LENGTH);
+    memcpy(dub_request.upperBoundUID, upper_uid, RDM_UID_LENGTH);
+
+    return queueRDMRequest(RDM_BROADCAST_UID, E120_DISCOVERY_COMMAND,
+                           E120_DISC_UNIQUE_BRANCH,
+                           reinterpret_cast<byte*>(&dub_request),
+                           sizeof(dub_request));
 }
 
 
-void TeensyDmx::sendRDMGetPanInvert(byte *uid) {
-    m_rdmBuffer.dataLength = 0;
+bool TeensyDmx::sendRDMGetDeviceInfo(byte *uid) {
+    return queueRDMRequest(uid, E120_GET_COMMAND, E120_DEVICE_INFO, nullptr, 0);
+}
+
 
-    buildSendRDMMessage(uid, E120_GET_COMMAND, E120_PAN_INVERT);
+bool TeensyDmx::sendRDMGetManufacturerLabel(byte *uid) {
+    return queueRDMRequest(uid, E120_GET_COMMAND, E120_MANUFACTURER_LABEL, nullptr, 0);
 }
 
 
-void TeensyDmx::sendRDMSetPanInvert(byte *uid, bool invert) {
-    if (invert) {
-        m_rdmBuffer.data[0] = 1;
+bool TeensyDmx::sendRDMGetDeviceLabel(byte *uid) {
+    return queueRDMRequest(uid, E120_GET_COMMAND, E120_DEVICE_LABEL, nullptr, 0);
+}
+
+
+bool TeensyDmx::sendRDMGetDeviceModelDescription(byte *uid) {
+    return queueRDMRequest(uid, E120_GET_COMMAND, E120_DEVICE_MODEL_DESCRIPTION, nullptr, 0);
+}
+
+
+bool TeensyDmx::sendRDMGetIdentifyDevice(byte *uid) {
+    return queueRDMRequest(uid, E120_GET_COMMAND, E120_IDENTIFY_DEVICE, nullptr, 0);
+}
+
+
+bool TeensyDmx::sendRDMSetIdentifyDevice(byte *uid, bool identify_state) {
+    byte data[1];
+    if (identify_state) {
+        data[0] = 1;
     } else {
-        m_rdmBuffer.data[0] = 0;
+        data[0] = 0;
     }
-    m_rdmBuffer.dataLength = 1;
 
-    buildSendRDMMessage(uid, E120_SET_COMMAND, E120_PAN_INVERT);
+    return queueRDMRequest(uid, E120_SET_COMMAND, E120_IDENTIFY_DEVICE, data, sizeof(data));
 }
 
 
-void TeensyDmx::sendRDMGetTiltInvert(byte *uid) {
-    m_rdmBuffer.dataLength = 0;
+bool TeensyDmx::sendRDMGetDmxStartAddress(byte *uid) {
+    return queueRDMRequest(uid, E120_GET_COMMAND, E120_DMX_START_ADDRESS, nullptr, 0);
+}
+
+
+bool TeensyDmx::sendRDMSetDmxStartAddress(byte *uid, uint16_t dmx_address) {
+    if ((dmx_address > 0) && (dmx_address <= DMX_UNIVERSE_SIZE)) {
+        byte data[2];
+        putUInt16(data, dmx_address);
 
-    buildSendRDMMessage(uid, E120_GET_COMMAND, E120_TILT_INVERT);
+        return queueRDMRequest(uid, E120_SET_COMMAND, E120_DMX_START_ADDRESS, data, sizeof(data));
+    }
+    return false;
 }
 
 
-void TeensyDmx::sendRDMSetTiltInvert(byte *uid, bool invert) {
-    if (invert) {
-        m_rdmBuffer.data[0] = 1;
-    } else {
-        m_rdmBuffer.data[0] = 0;
+bool TeensyDmx::sendRDMGetDmxPersonality(byte *uid) {
+    return queueRDMRequest(uid, E120_GET_COMMAND, E120_DMX_PERSONALITY, nullptr, 0);
+}
+
+
+bool TeensyDmx::sendRDMSetDmxPersonality(byte *uid, uint8_t personality) {
+    if (personality >= 1) {
+        return queueRDMRequest(uid, E120_SET_COMMAND, E120_DMX_PERSONALITY, &personality, 1);
     }
-    m_rdmBuffer.dataLength = 1;
+    return false;
+}
+
 
-    buildSendRDMMessage(uid, E120_SET_COMMAND, E120_TILT_INVERT);
+bool TeensyDmx::sendRDMGetDmxPersonalityDescription(byte *uid, uint8_t personality) {
+    if (personality >= 1) {
+        return queueRDMRequest(uid, E120_GET_COMMAND, E120_DMX_PERSONALITY_DESCRIPTION, &personality, 1);
+    }
+    return false;
 }
 
 
-void TeensyDmx::sendRDMGetPanTiltSwap(byte *uid) {
-    m_rdmBuffer.dataLength = 0;
+bool TeensyDmx::sendRDMSetResetDevice(byte *uid, uint8_t reset_mode) {
+    return queueRDMRequest(uid, E120_SET_COMMAND, E120_RESET_DEVICE, &reset_mode, 1);
+}
 
-    buildSendRDMMessage(uid, E120_GET_COMMAND, E120_PAN_TILT_SWAP);
+
+bool TeensyDmx::sendRDMGetPanInvert(byte *uid) {
+    return queueRDMRequest(uid, E120_GET_COMMAND, E120_PAN_INVERT, nullptr, 0);
 }
 
 
-void TeensyDmx::sendRDMSetPanTiltSwap(byte *uid, bool swap) {
-    if (swap) {
-        m_rdmBuffer.data[0] = 1;
+bool TeensyDmx::sendRDMSetPanInvert(byte *uid, bool invert) {
+    byte data[1];
+    if (invert) {
+        data[0] = 1;
     } else {
-        m_rdmBuffer.data[0] = 0;
+        data[0] = 0;
     }
-    m_rdmBuffer.dataLength = 1;
 
-    buildSendRDMMessage(uid, E120_SET_COMMAND, E120_PAN_TILT_SWAP);
+    return queueRDMRequest(uid, E120_SET_COMMAND, E120_PAN_INVERT, data, sizeof(data));
 }
 
 
-void TeensyDmx::sendRDMGetFactoryDefaults(byte *uid) {
-    m_rdmBuffer.dataLength = 0;
+bool TeensyDmx::sendRDMGetTiltInvert(byte *uid) {
+    return queueRDMRequest(uid, E120_GET_COMMAND, E120_TILT_INVERT, nullptr, 0);
+}
+
+
+bool TeensyDmx::sendRDMSetTiltInvert(byte *uid, bool invert) {
+    byte data[1];
+    if (invert) {
+        data[0] = 1;
+    } else {
+        data[0] = 0;
+    }
 
-    buildSendRDMMessage(uid, E120_GET_COMMAND, E120_FACTORY_DEFAULTS);
+    return queueRDMRequest(uid, E120_SET_COMMAND, E120_TILT_INVERT, data, sizeof(data));
 }
 
 
-void TeensyDmx::sendRDMSetFactoryDefaults(byte *uid) {
-    m_rdmBuffer.dataLength = 0;
+bool TeensyDmx::sendRDMGetPanTiltSwap(byte *uid) {
+    return queueRDMRequest(uid, E120_GET_COMMAND, E120_PAN_TILT_SWAP, nullptr, 0);
+}
+
+
+bool TeensyDmx::sendRDMSetPanTiltSwap(byte *uid, bool swap) {
+    byte data[1];
+    if (swap) {
+        data[0] = 1;
+    } else {
+        data[0] = 0;
+    }
 
-    buildSendRDMMessage(uid, E120_SET_COMMAND, E120_FACTORY_DEFAULTS);
+    return queueRDMRequest(uid, E120_SET_COMMAND, E120_PAN_TILT_SWAP, data, sizeof(data));
 }
 
 
-void TeensyDmx::sendRDMGetLampState(byte *uid) {
-    m_rdmBuffer.dataLength = 0;
+bool TeensyDmx::sendRDMGetFactoryDefaults(byte *uid) {
+    return queueRDMRequest(uid, E120_GET_COMMAND, E120_FACTORY_DEFAULTS, nullptr, 0);
+}
+
+
+bool TeensyDmx::sendRDMSetFactoryDefaults(byte *uid) {
+    return queueRDMRequest(uid, E120_SET_COMMAND, E120_FACTORY_DEFAULTS, nullptr, 0);
+}
+
 
-    buildSendRDMMessage(uid, E120_GET_COMMAND, E120_LAMP_STATE);
+bool TeensyDmx::sendRDMGetLampState(byte *uid) {
+    return queueRDMRequest(uid, E120_GET_COMMAND, E120_LAMP_STATE, nullptr, 0);
 }
 
 
-void TeensyDmx::sendRDMSetLampState(byte *uid, uint8_t lamp_state) {
+bool TeensyDmx::sendRDMSetLampState(byte *uid, uint8_t lamp_state) {
     if (((lamp_state >= E120_LAMP_OFF) &&
          (lamp_state <= E120_LAMP_STANDBY)) ||
         ((lamp_state >= 128) && (lamp_state <= 223))) {
-        m_rdmBuffer.data[0] = lamp_state;
-        m_rdmBuffer.dataLength = 1;
-
-        buildSendRDMMessage(uid, E120_SET_COMMAND, E120_LAMP_STATE);
+        return queueRDMRequest(uid, E120_SET_COMMAND, E120_LAMP_STATE, &lamp_state, 1);
     }
+    return false;
 }
 
 
-void TeensyDmx::sendRDMGetLampOnMode(byte *uid) {
-    m_rdmBuffer.dataLength = 0;
-
-    buildSendRDMMessage(uid, E120_GET_COMMAND, E120_LAMP_ON_MODE);
+bool TeensyDmx::sendRDMGetLampOnMode(byte *uid) {
+    return queueRDMRequest(uid, E120_GET_COMMAND, E120_LAMP_ON_MODE, nullptr, 0);
 }
 
 
-void TeensyDmx::sendRDMSetLampOnMode(byte *uid, uint8_t mode) {
+bool TeensyDmx::sendRDMSetLampOnMode(byte *uid, uint8_t mode) {
     if (((mode >= E120_LAMP_ON_MODE_OFF) &&
          (mode <= E120_LAMP_ON_MODE_AFTER_CAL)) ||
         ((mode >= 128) && (mode <= 223))) {
-        m_rdmBuffer.data[0] = mode;
-        m_rdmBuffer.dataLength = 1;
-
-        buildSendRDMMessage(uid, E120_SET_COMMAND, E120_LAMP_ON_MODE);
+        return queueRDMRequest(uid, E120_SET_COMMAND, E120_LAMP_ON_MODE, &mode, 1);
     }
+    return false;
 }
 
 
-void TeensyDmx::sendRDMGetPowerOnSelfTest(byte *uid) {
-    m_rdmBuffer.dataLength = 0;
-
-    buildSendRDMMessage(uid, E120_GET_COMMAND, E137_1_POWER_ON_SELF_TEST);
+bool TeensyDmx::sendRDMGetPowerOnSelfTest(byte *uid) {
+    return queueRDMRequest(uid, E120_GET_COMMAND, E137_1_POWER_ON_SELF_TEST, nullptr, 0);
 }
 
 
-void TeensyDmx::sendRDMSetPowerOnSelfTest(byte *uid, bool power_on_self_test) {
+bool TeensyDmx::sendRDMSetPowerOnSelfTest(byte *uid, bool power_on_self_test) {
+    byte data[1];
     if (power_on_self_test) {
-        m_rdmBuffer.data[0] = 1;
+        data[0] = 1;
     } else {
-        m_rdmBuffer.data[0] = 0;
+        data[0] = 0;
     }
-    m_rdmBuffer.dataLength = 1;
 
-    buildSendRDMMessage(uid, E120_SET_COMMAND, E137_1_POWER_ON_SELF_TEST);
+    return queueRDMRequest(uid, E120_SET_COMMAND, E137_1_POWER_ON_SELF_TEST, data, sizeof(data));
 }
 
 
-void TeensyDmx::sendRDMGetPerformSelftest(byte *uid) {
-    m_rdmBuffer.dataLength = 0;
-
-    buildSendRDMMessage(uid, E120_GET_COMMAND, E120_PERFORM_SELFTEST);
+bool TeensyDmx::sendRDMGetPerformSelftest(byte *uid) {
+    return queueRDMRequest(uid, E120_GET_COMMAND, E120_PERFORM_SELFTEST, nullptr, 0);
 }
 
 
-void TeensyDmx::sendRDMSetPerformSelftest(byte *uid, uint8_t test_number) {
-    m_rdmBuffer.data[0] = test_number;
-    m_rdmBuffer.dataLength = 1;
-
-    buildSendRDMMessage(uid, E120_SET_COMMAND, E120_PERFORM_SELFTEST);
+bool TeensyDmx::sendRDMSetPerformSelftest(byte *uid, uint8_t test_number) {
+    return queueRDMRequest(uid, E120_SET_COMMAND, E120_PERFORM_SELFTEST, &test_number, 1);
 }
 
 
-void TeensyDmx::sendRDMGetSelfTestDescription(byte *uid, uint8_t test_number) {
-    m_rdmBuffer.data[0] = test_number;
-    m_rdmBuffer.dataLength = 1;
-
-    buildSendRDMMessage(uid, E120_GET_COMMAND, E120_SELF_TEST_DESCRIPTION);
+bool TeensyDmx::sendRDMGetSelfTestDescription(byte *uid, uint8_t test_number) {
+    return queueRDMRequest(uid, E120_GET_COMMAND, E120_SELF_TEST_DESCRIPTION, &test_number, 1);
 }
 
 
-void TeensyDmx::sendRDMGetSensorDefinition(byte *uid, uint8_t sensor_number) {
+bool TeensyDmx::sendRDMGetSensorDefinition(byte *uid, uint8_t sensor_number) {
     if (sensor_number < 0xff) {
-        m_rdmBuffer.data[0] = sensor_number;
-        m_rdmBuffer.dataLength = 1;
-
-        buildSendRDMMessage(uid, E120_GET_COMMAND, E120_SENSOR_DEFINITION);
+        return queueRDMRequest(uid, E120_GET_COMMAND, E120_SENSOR_DEFINITION, &sensor_number, 1);
     }
+    return false;
 }
 
 
-void TeensyDmx::sendRDMGetSensorValue(byte *uid, uint8_t sensor_number) {
+bool TeensyDmx::sendRDMGetSensorValue(byte *uid, uint8_t sensor_number) {
     if (sensor_number < 0xff) {
-        m_rdmBuffer.data[0] = sensor_number;
-        m_rdmBuffer.dataLength = 1;
-
-        buildSendRDMMessage(uid, E120_GET_COMMAND, E120_SENSOR_VALUE);
+        return queueRDMRequest(uid, E120_GET_COMMAND, E120_SENSOR_VALUE, &sensor_number, 1);
     }
+    return false;
 }
 
 
-void TeensyDmx::sendRDMSetSensorValue(byte *uid, uint8_t sensor_number) {
-    m_rdmBuffer.data[0] = sensor_number;
-    m_rdmBuffer.dataLength = 1;
-
-    buildSendRDMMessage(uid, E120_SET_COMMAND, E120_SENSOR_VALUE);
+bool TeensyDmx::sendRDMSetSensorValue(byte *uid, uint8_t sensor_number) {
+    return queueRDMRequest(uid, E120_SET_COMMAND, E120_SENSOR_VALUE, &sensor_number, 1);
 }
 
 
-void TeensyDmx::sendRDMSetRecordSensors(byte *uid, uint8_t sensor_number) {
-    m_rdmBuffer.data[0] = sensor_number;
-    m_rdmBuffer.dataLength = 1;
-
-    buildSendRDMMessage(uid, E120_SET_COMMAND, E120_RECORD_SENSORS);
+bool TeensyDmx::sendRDMSetRecordSensors(byte *uid, uint8_t sensor_number) {
+    return queueRDMRequest(uid, E120_SET_COMMAND, E120_RECORD_SENSORS, &sensor_number, 1);
 }
 
 void TeensyDmx::processControllerRDM()
 {
+    // Work out when E1.20 lets us send our next request
+    m_rdmNextRequestAllowed = micros() + RDM_CONTROLLER_PACKET_SPACING;
+    if (m_controllerState == ControllerState::RDM_DUB ||
+            m_controllerState == ControllerState::RDM_DUB_COLLISION ||
+            m_controllerState == ControllerState::RDM_DUB_TIMEOUT) {
+        uint32_t dubSpacing = m_rdmRequestEnd + RDM_DUB_PACKET_SPACING;
+        if (static_cast<int32_t>(dubSpacing - m_rdmNextRequestAllowed) > 0) {
+            m_rdmNextRequestAllowed = dubSpacing;
+        }
+    }
+
     switch (m_controllerState)
     {
         case ControllerState::RDM_DUB:
+            processDiscovery();
+            if (m_requestInFlight) {
+                // Queued by the user, who wants to know who answered
+                decodeDubResponse();
+                completeRDMRequest(CallbackStatus::CB_SUCCESS, &m_rdmBuffer);
+            } else {
+                completeRDMRequest(CallbackStatus::CB_SUCCESS, NULL);
+            }
+            break;
         case ControllerState::RDM_DUB_COLLISION:
+            processDiscovery();
+            completeRDMRequest(CallbackStatus::CB_RDM_CHECKSUM_ERROR, NULL);
+            break;
         case ControllerState::RDM_DUB_TIMEOUT:
             processDiscovery();
+            completeRDMRequest(CallbackStatus::CB_RDM_TIMEOUT, NULL);
             break;
         case ControllerState::RDM_MESSAGE:
-            if (m_rdm != nullptr && m_rdm->controllerCallback != nullptr) {
-                m_rdm->controllerCallback(CallbackStatus::CB_SUCCESS, &m_rdmBuffer);
+            if (!isExpectedResponse()) {
+                // Not the response to our request, keep waiting for that one
+                // until it arrives or times out
+                return;
             }
+            if (m_requestInFlight) {
+                storeRDMCacheEntry(m_requestQueue[m_requestHead], m_rdmBuffer);
+            }
+            completeRDMRequest(CallbackStatus::CB_SUCCESS, &m_rdmBuffer);
             break;
         case ControllerState::RDM_CHECKSUM_ERROR:
-            if (m_rdm != nullptr && m_rdm->controllerCallback != nullptr) {
-                m_rdm->controllerCallback(CallbackStatus::CB_RDM_CHECKSUM_ERROR, NULL);
-            }
+            completeRDMRequest(CallbackStatus::CB_RDM_CHECKSUM_ERROR, NULL);
             break;
         case ControllerState::RDM_BROADCAST:
-            if (m_rdm != nullptr && m_rdm->controllerCallback != nullptr) {
-                m_rdm->controllerCallback(CallbackStatus::CB_RDM_BROADCAST, NULL);
-            }
+            completeRDMRequest(CallbackStatus::CB_RDM_BROADCAST, NULL);
             break;
         case ControllerState::RDM_TIMEOUT:
-            if (m_rdm != nullptr && m_rdm->controllerCallback != nullptr) {
-                m_rdm->controllerCallback(CallbackStatus::CB_RDM_TIMEOUT, NULL);
-            }
+            completeRDMRequest(CallbackStatus::CB_RDM_TIMEOUT, NULL);
             break;
         default:
             // Do nothing, unknown state
@@ -1507,8 +2685,10 @@ void TeensyDmx::processControllerRDM()
     //// Serial.println(m_rdmResponseDue);
     m_controllerState = ControllerState::CONTROLLER_IDLE;
 }
+#endif
 
 
+#if TEENSYDMX_RDM_RESPONDER
 void TeensyDmx::processResponderRDM()
 {
     if (m_rdm == nullptr) {
@@ -1617,78 +2797,273 @@ void TeensyDmx::processResponderRDM()
         }
     }
 }
+#endif
 
 
+#if TEENSYDMX_RDM_CONTROLLER
 void TeensyDmx::processDiscovery()
 {
     //// Serial.print("proc disc ");
     //// Serial.println(m_controllerState);
+    if (m_requestInFlight || (m_discoveryState == DiscoveryState::DISCOVERY_IDLE)) {
+        // A DUB sent by the user rather than discovery, nothing to do
+        m_controllerState = ControllerState::CONTROLLER_IDLE;
+        return;
+    }
     switch (m_controllerState)
     {
         case ControllerState::RDM_DUB:
             {
-                // Requeue the existing DUB, in case it was masking another UID
-                m_dubPointer++;
                 DiscUniqueBranchResponse *dub_response =
                     reinterpret_cast<DiscUniqueBranchResponse*>(&m_rdmBuffer);
                 for(int i = 0; i < RDM_UID_LENGTH; i++)
                 {
-                    m_uidList[(m_uidCount * RDM_UID_LENGTH) + i] =
-                        (dub_response->maskedDevID[i+i] &
-                         dub_response->maskedDevID[i+i+1]);
+                    m_lastFoundUid[i] = (dub_response->maskedDevID[i+i] &
+                                         dub_response->maskedDevID[i+i+1]);
                 }
-                m_uidCount++;
-                // Serial.print("Found a UID! UID count now ");
-                // Serial.println(m_uidCount);
+                // Colliding responses can merge into a UID which passes the
+                // checksum, so it's only added once the device answers the mute
                 m_discoveryState = DiscoveryState::DISCOVERY_MUTE;
-                m_nextDiscoveryAction = millis() + DISCOVERY_ACTION_OFFSET;
             }
             break;
         case ControllerState::RDM_DUB_COLLISION:
         {
             // Serial.println("Collision");
+            ++m_discoveryStats.collisionCount;
             //// Serial.println("Doing binary search");
             //uint64_t midPosition = ((m_dubLowerBoundUid & (0x0000800000000000-1)) +
             //                         (m_dubUpperBoundUid & (0x0000800000000000-1))) / 2)
             //                       + ((m_dubUpperBoundUid & 0x0000800000000000) ? 0x0000400000000000 : 0)
             //                       + ((m_dubLowerBoundUid & 0x0000800000000000) ? 0x0000400000000000 : 0);
-            uint64_t midPosition = ((m_dubLowerBoundUid + m_dubUpperBoundUid) / 2);
-            m_dubQueue[(m_dubPointer * 2)] = m_dubLowerBoundUid;
-            m_dubQueue[(m_dubPointer * 2) + 1] = midPosition;
-            m_dubPointer++;
-            m_dubQueue[(m_dubPointer * 2)] = (midPosition + 1);
-            m_dubQueue[(m_dubPointer * 2) + 1] = m_dubUpperBoundUid;
-            m_dubPointer++;
+            if (m_dubLowerBoundUid == m_dubUpperBoundUid) {
+                // Two devices answering for a single UID, nothing left to split
+                break;
+            }
+            if (m_dubDecodingActive && m_dubResponseComplete && decodeDubCollision()) {
+                ++m_discoveryStats.decodedCount;
+                break;
+            }
+            splitDubRange();
             // Serial.print("DUB pointer now ");
             // Serial.println(m_dubPointer);
-            // Serial.println("Pausing before next DUB");
-            m_nextDiscoveryAction = millis() + DUB_ACTION_OFFSET;
-            //// Serial.println(millis());
-            //// Serial.println(m_nextDiscoveryAction);
             //m_dubUpperboundUid = MidPosition;
             break;
        }
        case ControllerState::RDM_DUB_TIMEOUT:
-            // Serial.print("DUB Timeout ");
-            // Serial.println(m_nextDiscoveryAction);
-            if (m_dubPointer > 0) {
-              // Keep discovering...
-              // Serial.println("Pausing before next DUB");
-              m_nextDiscoveryAction = millis() + DUB_ACTION_OFFSET;
-            } else {
-              // Nothing left to do, return the list
-              if (m_rdm != nullptr && m_rdm->discoveryCallback != nullptr) {
-                  m_rdm->discoveryCallback(CallbackStatus::CB_SUCCESS, m_uidList, m_uidCount);
-              }
-            }
+            // Serial.println("DUB Timeout");
             break;
         default:
             break;
     }
     m_controllerState = ControllerState::CONTROLLER_IDLE;
+    m_discoveryStats.rangesRemaining = m_dubPointer;
+    m_discoveryStats.elapsedMicros = micros() - m_discoveryStart;
+    if (m_rdm != nullptr && m_rdm->discoveryProgressCallback != nullptr) {
+        m_rdm->discoveryProgressCallback(m_discoveryStats);
+    }
+    if ((m_dubPointer == 0) && (m_discoveryState == DiscoveryState::DISCOVERY_DUB)) {
+        completeRDMDiscovery();
+    }
+}
+
+
+void TeensyDmx::decodeDubResponse()
+{
+    // Rewrite the raw DUB response as an RdmData from the UID which sent it,
+    // so it reads like the response to any other request
+    DiscUniqueBranchResponse *dub_response =
+        reinterpret_cast<DiscUniqueBranchResponse*>(&m_rdmBuffer);
+    byte uid[RDM_UID_LENGTH];
+    for (int i = 0; i < RDM_UID_LENGTH; i++) {
+        uid[i] = (dub_response->maskedDevID[i+i] & dub_response->maskedDevID[i+i+1]);
+    }
+    m_rdmBuffer.startCode = E120_SC_RDM;
+    m_rdmBuffer.subStartCode = E120_SC_SUB_MESSAGE;
+    m_rdmBuffer.length = RDM_PACKET_SIZE_NO_PD;
+    memcpy(m_rdmBuffer.destId, m_rdm->uid, RDM_UID_LENGTH);
+    memcpy(m_rdmBuffer.sourceId, uid, RDM_UID_LENGTH);
+    m_rdmBuffer.transNo = m_lastTransactionNumber;
+    m_rdmBuffer.responseType = E120_RESPONSE_TYPE_ACK;
+    m_rdmBuffer.messageCount = 0;
+    putUInt16(&m_rdmBuffer.subDev, 0);
+    m_rdmBuffer.cmdClass = E120_DISCOVERY_COMMAND_RESPONSE;
+    putUInt16(&m_rdmBuffer.parameter, E120_DISC_UNIQUE_BRANCH);
+    m_rdmBuffer.dataLength = 0;
+}
+
+
+bool TeensyDmx::decodeDubCollision()
+{
+    // On a wired-OR line, if the responses lined up, each bit we received is
+    // the OR of that bit from every colliding UID. Only called when the user
+    // has told us the line works that way, as other lines would have us
+    // skip real devices. Check the mask bits survived, otherwise the
+    // responses were skewed and we can't trust any of it
+    DiscUniqueBranchResponse *dub_response =
+        reinterpret_cast<DiscUniqueBranchResponse*>(&m_rdmBuffer);
+    uint64_t merged = 0;
+    for (int i = 0; i < RDM_UID_LENGTH; i++) {
+        byte even = dub_response->maskedDevID[i+i];
+        byte odd = dub_response->maskedDevID[i+i+1];
+        if (((even & 0xAA) != 0xAA) || ((odd & 0x55) != 0x55)) {
+            return false;
+        }
+        merged = (merged << 8) | (even & odd);
+    }
+
+    // Every responding UID only has bits which are set in merged, so none
+    // can be above it
+    uint64_t upper = (merged < m_dubUpperBoundUid) ? merged : m_dubUpperBoundUid;
+    if (upper < m_dubLowerBoundUid) {
+        return false;
+    }
+    // Split on the highest bit which varies across what's left of the range
+    uint64_t varying = m_dubLowerBoundUid ^ upper;
+    if (varying == 0) {
+        // Only one UID left, which must be the one we'll find
+        pushDubRange(upper, upper);
+        m_dubPruned = true;
+        return true;
+    }
+    uint64_t bit = 1;
+    while (varying >>= 1) {
+        bit <<= 1;
+    }
+    uint64_t prefix = m_dubLowerBoundUid & ~((bit << 1) - 1);
+    if ((merged & ~((bit << 1) - 1)) != prefix) {
+        // The merged bits above the split disagree with the range, so it
+        // wasn't a clean OR
+        return false;
+    }
+    // UIDs with the bit clear can't be above merged with that bit cleared,
+    // UIDs with it set can't be above merged
+    uint64_t lowUpper = merged & ~bit;
+    if (lowUpper > (prefix | (bit - 1))) {
+        lowUpper = prefix | (bit - 1);
+    }
+    uint64_t highLower = prefix | bit;
+    bool lowPossible = (lowUpper >= m_dubLowerBoundUid);
+    bool highPossible = ((merged & bit) != 0) && (upper >= highLower);
+    if (!lowPossible && !highPossible) {
+        return false;
+    }
+    if (lowPossible) {
+        pushDubRange(m_dubLowerBoundUid, lowUpper);
+    }
+    if (highPossible) {
+        pushDubRange(highLower, upper);
+    }
+    if ((lowUpper != (prefix | (bit - 1))) || (upper != m_dubUpperBoundUid)) {
+        m_dubPruned = true;
+    }
+    return true;
+}
+
+
+void TeensyDmx::splitDubRange()
+{
+    uint64_t midPosition = ((m_dubLowerBoundUid + m_dubUpperBoundUid) / 2);
+    pushDubRange(m_dubLowerBoundUid, midPosition);
+    pushDubRange((midPosition + 1), m_dubUpperBoundUid);
 }
 
 
+void TeensyDmx::processMuteResponse(CallbackStatus status)
+{
+    m_mutePending = false;
+    if (status == CallbackStatus::CB_RDM_TIMEOUT) {
+        // Nothing has that UID, so it was colliding responses that happened
+        // to pass the checksum; carry on as if it was a collision
+        ++m_discoveryStats.collisionCount;
+        if (m_dubLowerBoundUid != m_dubUpperBoundUid) {
+            splitDubRange();
+        }
+        return;
+    }
+    // Anything else, even a corrupt reply, means something is there
+    RdmUidSet::Result result = m_uids.insert(m_lastFoundUid);
+    if (result == RdmUidSet::UID_ADDED) {
+        m_uidTableChanged = true;
+        ++m_uidVersion;
+        sendUidEvent(RdmUidEvent::UID_EVENT_ADDED, m_lastFoundUid);
+    } else if (result == RdmUidSet::UID_FULL) {
+        // Keep going so the line is fully muted, but tell the
+        // user the list is incomplete
+        m_uidOverflow = true;
+    }
+    if (result != RdmUidSet::UID_DUPLICATE) {
+        // Requeue the existing DUB, in case it was masking another UID
+        pushDubRange(m_dubLowerBoundUid, m_dubUpperBoundUid);
+    } else if (m_dubLowerBoundUid != m_dubUpperBoundUid) {
+        // The device ignored an earlier mute, split the range rather than
+        // go round in circles so anything else in it is still found
+        splitDubRange();
+    }
+}
+
+
+void TeensyDmx::processVerifyResponse(CallbackStatus status)
+{
+    m_verifyPending = false;
+    if (status == CallbackStatus::CB_RDM_TIMEOUT) {
+        if (++m_verifyAttempts < MAX_VERIFY_ATTEMPTS) {
+            // Try it again before we give up on it
+            return;
+        }
+        // It's gone, the next UID shuffles down into this index
+        byte uid[RDM_UID_LENGTH];
+        memcpy(uid, m_uids.get(m_verifyIndex), RDM_UID_LENGTH);
+        m_uids.remove(m_verifyIndex);
+        m_uidTableChanged = true;
+        ++m_uidVersion;
+        sendUidEvent(RdmUidEvent::UID_EVENT_REMOVED, uid);
+    } else {
+        // Anything else, even a corrupt reply, means something is there
+        ++m_verifyIndex;
+    }
+    m_verifyAttempts = 0;
+}
+
+
+void TeensyDmx::sendUidEvent(RdmUidEvent event, const byte *uid)
+{
+    if (m_rdm != nullptr && m_rdm->uidEventCallback != nullptr) {
+        m_rdm->uidEventCallback(event, uid);
+    }
+}
+
+
+void TeensyDmx::completeRDMDiscovery()
+{
+    if (m_dubPruned) {
+        // We skipped parts of the UID space on the strength of decoded
+        // collisions, do a plain check of the whole lot to catch anything
+        // that assumption hid. Found devices are muted so this is normally
+        // a single DUB with no response
+        m_dubPruned = false;
+        m_dubDecodingActive = false;
+        pushDubRange(RDM_MIN_LOWER_BOUND_UID, RDM_MAX_UPPER_BOUND_UID);
+        m_discoveryState = DiscoveryState::DISCOVERY_DUB;
+        return;
+    }
+    // Nothing left to do, return the list
+    m_discoveryState = DiscoveryState::DISCOVERY_IDLE;
+    m_lastDiscoveryEnd = millis();
+    if (m_uidTableChanged && (m_uidStorageAddress >= 0)) {
+        // Only write when something changed, to spare the EEPROM
+        m_uidTableChanged = !saveRDMUids(m_uidStorageAddress);
+    }
+    m_discoveryStats.elapsedMicros = micros() - m_discoveryStart;
+    if (m_rdm != nullptr && m_rdm->discoveryCallback != nullptr) {
+        m_rdm->discoveryCallback(m_uidOverflow ? CallbackStatus::CB_RDM_UID_OVERFLOW :
+                                                 CallbackStatus::CB_SUCCESS,
+                                 m_uids.data(), m_uids.count());
+    }
+}
+#endif
+
+
+#if TEENSYDMX_RDM_RESPONDER
 void TeensyDmx::respondMessage(uint16_t nackReason)
 {
     // swap SrcID into DestID for sending back.
@@ -1712,44 +3087,126 @@ void TeensyDmx::respondMessage(uint16_t nackReason)
 
     sendRDMMessage();
 }
+#endif
+
+
+#if TEENSYDMX_RDM_CONTROLLER
+void TeensyDmx::sendDiscoveryRequest(const byte *uid, uint16_t pid,
+                                     const byte *data, uint8_t dataLength)
+{
+    RdmRequest request;
+    fillRDMRequest(request, uid, E120_DISCOVERY_COMMAND, pid, data, dataLength);
+    sendRDMRequest(request);
+}
 
 
-void TeensyDmx::buildSendRDMMessage(byte *uid, uint8_t commandClass, uint16_t pid) {
+void TeensyDmx::sendRDMRequest(const RdmRequest& request) {
     if (m_rdm != nullptr) {
         m_rdmBuffer.startCode = E120_SC_RDM;
         m_rdmBuffer.subStartCode = E120_SC_SUB_MESSAGE;
 
-        memcpy(m_rdmBuffer.destId, uid, RDM_UID_LENGTH);
+        memcpy(m_rdmBuffer.destId, request.destId, RDM_UID_LENGTH);
         memcpy(m_rdmBuffer.sourceId, m_rdm->uid, RDM_UID_LENGTH);
 
         // Sub Dev
-        putUInt16(&m_rdmBuffer.subDev, RDM_ROOT_DEVICE);
+        putUInt16(&m_rdmBuffer.subDev, request.subDev);
 
         m_rdmBuffer.messageCount = 0; // Number of queued messages
         m_rdmBuffer.responseType = 1; // Port 1
-        m_rdmBuffer.transNo = 0;
+        // Every transaction gets its own number so we can match the response
+        m_lastTransactionNumber = m_transactionNumber++;
+        m_rdmBuffer.transNo = m_lastTransactionNumber;
         // Parameter
-        putUInt16(&m_rdmBuffer.parameter, pid);
-
-        m_rdmBuffer.cmdClass = commandClass;
-
-        sendRDMMessage();
-        if ((commandClass != E120_DISCOVERY_COMMAND) && isForMany(uid)) {
-            // Don't interfere with discovery messages, but if it's a set or
-            // someone is doing a broadcast get for some crazy reason, don't
-            // expect a reply for broadcast or vendorcast messages
+        putUInt16(&m_rdmBuffer.parameter, request.pid);
+
+        m_rdmBuffer.cmdClass = request.cmdClass;
+
+        m_rdmBuffer.dataLength = request.dataLength;
+        memcpy(m_rdmBuffer.data, request.data, request.dataLength);
+
+        m_dubResponseComplete = false;
+        m_latencyPending = false;
+        if ((request.cmdClass == E120_DISCOVERY_COMMAND) &&
+                (request.pid == E120_DISC_UNIQUE_BRANCH)) {
+            // DUB responses are special, they have no break and may collide
+            m_controllerState = ControllerState::RDM_DUB;
+        } else if (isForMany(request.destId)) {
+            // Don't expect a reply for broadcast or vendorcast messages, this
+            // includes the un-mute at the start of discovery
             m_controllerState = ControllerState::RDM_BROADCAST;
-            m_state = State::IDLE;
-            // Fake up processing of the "data"
-            m_rdmNeedsProcessing = true;
         } else {
             m_controllerState = ControllerState::RDM_MESSAGE;
-            m_rdmResponseDue = millis() + RDM_TIMEOUT_DURATION;
+            // Only application requests and their follow-ups count, not the
+            // mutes sent by discovery
+            m_statsPending = m_requestInFlight || m_deferredInFlight >= 0;
+            if (m_statsPending) {
+                memcpy(m_statsUid, request.destId, RDM_UID_LENGTH);
+                RdmDeviceStats *stats = getRDMDeviceStatsEntry(request.destId);
+                ++stats->requests;
+                stats->lastUsed = millis();
+            }
+        }
+        m_rdmBuffer.length = m_rdmBuffer.dataLength + RDM_PACKET_SIZE_NO_PD;  // total packet length
+        m_rdmTxChecksum = rdmCalculateChecksum(reinterpret_cast<uint8_t*>(&m_rdmBuffer),
+                                               m_rdmBuffer.length);
+        m_rdmTransmitting = true;
+        // The TX interrupt sends it and then sets up for the response, so
+        // we don't sit here waiting and other ports can get on with it
+        if (m_mode == DMX_OUT && !m_dmxPaused) {
+            // DMX is running, the TX interrupt sends it once the current
+            // frame and any others still owed are done
+            __disable_irq();
+            m_rdmTransmitPending = true;
+            __enable_irq();
+        } else {
+            startRDMTransmit();
         }
     }
 }
 
+void TeensyDmx::startRDMTransmit()
+{
+    m_dmxPaused = true;
+    stopTransmit();
+    stopReceive();
+    setDirection(true);
+    attachTxInterrupt();
+
+    // Send BREAK, the TX interrupt then sends the rest
+    m_state = State::RDM_TX_BREAK;
+    m_uart.begin(RDM_BREAKSPEED, BREAKFORMAT);
+    m_uart.write(0);
+}
+
+// Called from the TX interrupt once the last byte of a request has gone
+void TeensyDmx::finishRDMTransmit()
+{
+    m_rdmRequestEnd = micros();
+    m_state = State::IDLE;
+    startReceive();
+    switch (m_controllerState)
+    {
+        case ControllerState::RDM_DUB:
+            m_state = State::RDM_DUB_PRE_PREAMBLE;
+            m_latencyPending = true;
+            m_rdmResponseDue = m_rdmRequestEnd + RDM_RESPONSE_TIMEOUT + m_rdmTimeoutMargin;
+            m_rdmResponseStarted = false;
+            break;
+        case ControllerState::RDM_BROADCAST:
+            // Fake up processing of the "data"
+            m_rdmNeedsProcessing = true;
+            break;
+        default:
+            m_latencyPending = true;
+            m_rdmResponseDue = m_rdmRequestEnd + RDM_RESPONSE_TIMEOUT + m_rdmTimeoutMargin;
+            m_rdmResponseStarted = false;
+            break;
+    }
+    m_rdmTransmitting = false;
+}
+#endif
 
+#if TEENSYDMX_RDM_RESPONDER
 void TeensyDmx::sendRDMMessage()
 {
     m_state = IDLE;
@@ -1780,12 +3237,13 @@ void TeensyDmx::sendRDMMessage()
     // Restart receive
     startReceive();
 }
+#endif
 
-void uart0_error_isr();  // Back reference to serial1.c
 // UART0 will throw a frame error on the DMX break pulse.  That's our
 // cue to switch buffers and reset the index to zero
 void UART0RxError(void)
 {
+    TeensyDmx::ProfileScope profile(uartInstances[0], PROFILE_RX_ERROR);
     // On break, uart0_status_isr() will probably have already
     // fired and read the data buffer, clearing the framing error.
     // If for some reason it hasn't, make sure we consume the 0x00
@@ -1797,11 +3255,11 @@ void UART0RxError(void)
     uartInstances[0]->completeFrame();
 }
 
-void uart1_error_isr();  // Back reference to serial2.c
 // UART1 will throw a frame error on the DMX break pulse.  That's our
 // cue to switch buffers and reset the index to zero
 void UART1RxError(void)
 {
+    TeensyDmx::ProfileScope profile(uartInstances[1], PROFILE_RX_ERROR);
     // On break, uart1_status_isr() will probably have already
     // fired and read the data buffer, clearing the framing error.
     // If for some reason it hasn't, make sure we consume the 0x00
@@ -1813,11 +3271,11 @@ void UART1RxError(void)
     uartInstances[1]->completeFrame();
 }
 
-void uart2_error_isr();  // Back reference to serial3.c
 // UART2 will throw a frame error on the DMX break pulse.  That's our
 // cue to switch buffers and reset the index to zero
 void UART2RxError(void)
 {
+    TeensyDmx::ProfileScope profile(uartInstances[2], PROFILE_RX_ERROR);
     // On break, uart2_status_isr() will probably have already
     // fired and read the data buffer, clearing the framing error.
     // If for some reason it hasn't, make sure we consume the 0x00
@@ -1830,11 +3288,11 @@ void UART2RxError(void)
 }
 
 #ifdef HAS_KINETISK_UART3
-void uart3_error_isr();  // Back reference to serial4.c
 // UART3 will throw a frame error on the DMX break pulse.  That's our
 // cue to switch buffers and reset the index to zero
 void UART3RxError(void)
 {
+    TeensyDmx::ProfileScope profile(uartInstances[3], PROFILE_RX_ERROR);
     // On break, uart3_status_isr() will probably have already
     // fired and read the data buffer, clearing the framing error.
     // If for some reason it hasn't, make sure we consume the 0x00
@@ -1848,11 +3306,11 @@ void UART3RxError(void)
 #endif
 
 #ifdef HAS_KINETISK_UART4
-void uart4_error_isr();  // Back reference to serial5.c
 // UART4 will throw a frame error on the DMX break pulse.  That's our
 // cue to switch buffers and reset the index to zero
 void UART4RxError(void)
 {
+    TeensyDmx::ProfileScope profile(uartInstances[4], PROFILE_RX_ERROR);
     // On break, uart4_status_isr() will probably have already
     // fired and read the data buffer, clearing the framing error.
     // If for some reason it hasn't, make sure we consume the 0x00
@@ -1866,11 +3324,11 @@ void UART4RxError(void)
 #endif
 
 #ifdef HAS_KINETISK_UART5
-void uart5_error_isr();  // Back reference to serial6.c
 // UART2 will throw a frame error on the DMX break pulse.  That's our
 // cue to switch buffers and reset the index to zero
 void UART5RxError(void)
 {
+    TeensyDmx::ProfileScope profile(uartInstances[5], PROFILE_RX_ERROR);
     // On break, uart5_status_isr() will probably have already
     // fired and read the data buffer, clearing the framing error.
     // If for some reason it hasn't, make sure we consume the 0x00
@@ -1885,6 +3343,7 @@ void UART5RxError(void)
 
 void UART0RxStatus()
 {
+    TeensyDmx::ProfileScope profile(uartInstances[0], PROFILE_RX_STATUS);
     uint8_t s = UART0_S1;
 #ifdef HAS_KINETISK_UART0_FIFO
 	if (s & (UART_S1_RDRF | UART_S1_IDLE)) {
@@ -1920,6 +3379,7 @@ void UART0RxStatus()
 
 void UART1RxStatus()
 {
+    TeensyDmx::ProfileScope profile(uartInstances[1], PROFILE_RX_STATUS);
     uint8_t s = UART1_S1;
 #ifdef HAS_KINETISK_UART1_FIFO
 	if (s & (UART_S1_RDRF | UART_S1_IDLE)) {
@@ -1953,6 +3413,7 @@ void UART1RxStatus()
 
 void UART2RxStatus()
 {
+    TeensyDmx::ProfileScope profile(uartInstances[2], PROFILE_RX_STATUS);
     uint8_t s = UART2_S1;
 #ifdef HAS_KINETISK_UART2_FIFO
 	if (s & (UART_S1_RDRF | UART_S1_IDLE)) {
@@ -1987,6 +3448,7 @@ void UART2RxStatus()
 #ifdef HAS_KINETISK_UART3
 void UART3RxStatus()
 {
+    TeensyDmx::ProfileScope profile(uartInstances[3], PROFILE_RX_STATUS);
     uint8_t s = UART3_S1;
 #ifdef HAS_KINETISK_UART3_FIFO
 	if (s & (UART_S1_RDRF | UART_S1_IDLE)) {
@@ -2022,6 +3484,7 @@ void UART3RxStatus()
 #ifdef HAS_KINETISK_UART4
 void UART4RxStatus()
 {
+    TeensyDmx::ProfileScope profile(uartInstances[4], PROFILE_RX_STATUS);
     uint8_t s = UART4_S1;
 #ifdef HAS_KINETISK_UART4_FIFO
 	if (s & (UART_S1_RDRF | UART_S1_IDLE)) {
@@ -2057,6 +3520,7 @@ void UART4RxStatus()
 #ifdef HAS_KINETISK_UART5
 void UART5RxStatus()
 {
+    TeensyDmx::ProfileScope profile(uartInstances[5], PROFILE_RX_STATUS);
     uint8_t s = UART5_S1;
 #ifdef HAS_KINETISK_UART5_FIFO
     if (s & (UART_S1_RDRF | UART_S1_IDLE)) {
@@ -2111,7 +3575,7 @@ void TeensyDmx::startReceive()
 #endif
         NVIC_ENABLE_IRQ(IRQ_UART0_STATUS);
 
-        attachInterruptVector(IRQ_UART0_STATUS, UART0RxStatus);
+        attachInterruptVector(IRQ_UART0_STATUS, m_isrs.rxStatus);
 
 #ifdef HAS_KINETISK_UART0_FIFO
         // Set error IRQ priority lower than that of the status IRQ,
@@ -2122,7 +3586,7 @@ void TeensyDmx::startReceive()
 
         // Enable UART0 interrupt on frame error and enable IRQ
         NVIC_ENABLE_IRQ(IRQ_UART0_ERROR);
-        attachInterruptVector(IRQ_UART0_ERROR, UART0RxError);
+        attachInterruptVector(IRQ_UART0_ERROR, m_isrs.rxError);
 #endif
     } else if (&m_uart == &Serial2) {
         // Change interrupt vector to mine to monitor RX complete
@@ -2139,7 +3603,7 @@ void TeensyDmx::startReceive()
 #endif
         NVIC_ENABLE_IRQ(IRQ_UART1_STATUS);
 
-        attachInterruptVector(IRQ_UART1_STATUS, UART1RxStatus);
+        attachInterruptVector(IRQ_UART1_STATUS, m_isrs.rxStatus);
 
 #ifdef HAS_KINETISK_UART1_FIFO
         // Set error IRQ priority lower than that of the status IRQ,
@@ -2150,7 +3614,7 @@ void TeensyDmx::startReceive()
 
         // Enable UART0 interrupt on frame error and enable IRQ
         NVIC_ENABLE_IRQ(IRQ_UART1_ERROR);
-        attachInterruptVector(IRQ_UART1_ERROR, UART1RxError);
+        attachInterruptVector(IRQ_UART1_ERROR, m_isrs.rxError);
 #endif
     } else if (&m_uart == &Serial3) {
         // Change interrupt vector to mine to monitor RX complete
@@ -2167,7 +3631,7 @@ void TeensyDmx::startReceive()
 #endif
         NVIC_ENABLE_IRQ(IRQ_UART2_STATUS);
 
-        attachInterruptVector(IRQ_UART2_STATUS, UART2RxStatus);
+        attachInterruptVector(IRQ_UART2_STATUS, m_isrs.rxStatus);
 
 #ifdef HAS_KINETISK_UART2_FIFO
         // Set error IRQ priority lower than that of the status IRQ,
@@ -2178,7 +3642,7 @@ void TeensyDmx::startReceive()
 
         // Enable UART0 interrupt on frame error and enable IRQ
         NVIC_ENABLE_IRQ(IRQ_UART2_ERROR);
-        attachInterruptVector(IRQ_UART2_ERROR, UART2RxError);
+        attachInterruptVector(IRQ_UART2_ERROR, m_isrs.rxError);
 #endif
     }
 #ifdef HAS_KINETISK_UART3
@@ -2194,7 +3658,7 @@ void TeensyDmx::startReceive()
 #endif
         NVIC_ENABLE_IRQ(IRQ_UART3_STATUS);
 
-        attachInterruptVector(IRQ_UART3_STATUS, UART3RxStatus);
+        attachInterruptVector(IRQ_UART3_STATUS, m_isrs.rxStatus);
 
 #ifdef HAS_KINETISK_UART3_FIFO
         // Set error IRQ priority lower than that of the status IRQ,
@@ -2206,7 +3670,7 @@ void TeensyDmx::startReceive()
         // Enable UART3 interrupt on frame error and enable IRQ
         NVIC_ENABLE_IRQ(IRQ_UART3_ERROR);
 
-        attachInterruptVector(IRQ_UART3_ERROR, UART3RxError);
+        attachInterruptVector(IRQ_UART3_ERROR, m_isrs.rxError);
 #endif
     }
 #endif
@@ -2223,7 +3687,7 @@ void TeensyDmx::startReceive()
 #endif
         NVIC_ENABLE_IRQ(IRQ_UART4_STATUS);
 
-        attachInterruptVector(IRQ_UART4_STATUS, UART4RxStatus);
+        attachInterruptVector(IRQ_UART4_STATUS, m_isrs.rxStatus);
 
 #ifdef HAS_KINETISK_UART4_FIFO
         // Set error IRQ priority lower than that of the status IRQ,
@@ -2235,7 +3699,7 @@ void TeensyDmx::startReceive()
         // Enable UART2 interrupt on frame error and enable IRQ
         NVIC_ENABLE_IRQ(IRQ_UART4_ERROR);
 
-        attachInterruptVector(IRQ_UART4_ERROR, UART4RxError);
+        attachInterruptVector(IRQ_UART4_ERROR, m_isrs.rxError);
 #endif
     }
 #endif
@@ -2252,7 +3716,7 @@ void TeensyDmx::startReceive()
 #endif
         NVIC_ENABLE_IRQ(IRQ_UART5_STATUS);
 
-        attachInterruptVector(IRQ_UART5_STATUS, UART5RxStatus);
+        attachInterruptVector(IRQ_UART5_STATUS, m_isrs.rxStatus);
 
 #ifdef HAS_KINETISK_UART5_FIFO
         // Set error IRQ priority lower than that of the status IRQ,
@@ -2264,7 +3728,7 @@ void TeensyDmx::startReceive()
         // Enable UART5 interrupt on frame error and enable IRQ
         NVIC_ENABLE_IRQ(IRQ_UART5_ERROR);
 
-        attachInterruptVector(IRQ_UART5_ERROR, UART5RxError);
+        attachInterruptVector(IRQ_UART5_ERROR, m_isrs.rxError);
 #endif
     }
 #endif
@@ -2358,6 +3822,32 @@ inline void TeensyDmx::setDirection(bool transmit) {
     if (m_redePin != nullptr) {
         *m_redePin = (transmit ? 1 : 0);
     }
+#ifdef KINETISK
+    if (m_rtsConfig != nullptr) {
+        // RTS drops whenever the transmitter is idle, which it is between
+        // the bytes we send from the TX complete interrupt and after a
+        // break, so it only has the pin for the last byte of a request
+        m_rtsHandoverPending = false;
+        *m_rtsConfig = PORT_PCR_MUX(1) | PORT_PCR_DSE | PORT_PCR_SRE;
+        *m_uartModem &= ~UART_MODEM_TXRTSE;
+    }
+#endif
+}
+
+// Called from the TX interrupt with the UART's S1. Once the last byte of a
+// request is in the transmitter RTS is asserted, so it can take over RE/DE
+// without a glitch and drop it the moment the final stop bit has gone.
+void TeensyDmx::maybeHandOverDirection(uint8_t s1)
+{
+#ifdef KINETISK
+    if (m_rtsHandoverPending && !(s1 & UART_S1_TC)) {
+        m_rtsHandoverPending = false;
+        *m_uartModem |= UART_MODEM_TXRTSE | UART_MODEM_TXRTSPOL;
+        *m_rtsConfig = PORT_PCR_MUX(3) | PORT_PCR_DSE | PORT_PCR_SRE;
+    }
+#else
+    (void)s1;
+#endif
 }
 
 void TeensyDmx::handleByte(uint8_t c)
@@ -2372,21 +3862,28 @@ void TeensyDmx::handleByte(uint8_t c)
                     // In DMX mode we don't keep the start code
                     m_dmxBufferIndex = 0;
                     break;
+#if TEENSYDMX_RDM
                 case E120_SC_RDM:
                     m_rdmNeedsProcessing = false;
                     // Store the start code and then increment
                     reinterpret_cast<uint8_t*>(&m_rdmBuffer)[0] = c;
+                    m_rdmRunningChecksum = c;
                     m_dmxBufferIndex = 1;
                     m_state = State::RDM_RECV;
                     break;
+#endif
                 default:
                     // ASC
                     m_state = State::IDLE;
                     break;
             }
             break;
+#if TEENSYDMX_RDM
         case State::RDM_RECV:
             reinterpret_cast<uint8_t*>(&m_rdmBuffer)[m_dmxBufferIndex] = c;
+            // Accumulate the checksum as we go so we don't have to walk the
+            // whole packet in the ISR when the last byte arrives
+            m_rdmRunningChecksum += c;
             ++m_dmxBufferIndex;
             if (m_dmxBufferIndex >= sizeof(RdmData)) {
                 m_state = State::RDM_RECV_CHECKSUM_HI;
@@ -2408,13 +3905,21 @@ void TeensyDmx::handleByte(uint8_t c)
         case State::RDM_RECV_CHECKSUM_LO:
             m_rdmChecksum = (m_rdmChecksum | c);
             ++m_dmxBufferIndex;
-            if (m_rdmChecksum ==
-                    rdmCalculateChecksum(
-                        reinterpret_cast<uint8_t*>(&m_rdmBuffer),
-                        m_rdmBuffer.length)) {
+#if TEENSYDMX_RDM_CONTROLLER
+            m_rdmResponseEnd = micros();
+#endif
+            // The running checksum only covers the bytes we stored, which
+            // must be exactly the packet length for the packet to be valid
+            if ((m_dmxBufferIndex == (m_rdmBuffer.length + 2)) &&
+                    (m_rdmChecksum == m_rdmRunningChecksum)) {
                 m_rdmNeedsProcessing = true;
             } else {
-                m_controllerState = ControllerState::RDM_CHECKSUM_ERROR;
+#if TEENSYDMX_RDM_CONTROLLER
+                if (m_controllerState == ControllerState::RDM_MESSAGE) {
+                    // Only a controller waiting for a response cares
+                    m_controllerState = ControllerState::RDM_CHECKSUM_ERROR;
+                }
+#endif
                 maybeIncrementChecksumFail();
             }
             m_state = State::RDM_RECV_POST_CHECKSUM;
@@ -2423,7 +3928,10 @@ void TeensyDmx::handleByte(uint8_t c)
             maybeIncrementLengthMismatch();
             m_state = State::IDLE;
             break;
+#endif
+#if TEENSYDMX_RDM_CONTROLLER
         case State::RDM_DUB_PRE_PREAMBLE:
+            noteRDMResponseStart();
             // Fall through
         case State::RDM_DUB_PREAMBLE:
             //// Serial.println("DUB preamble");
@@ -2432,6 +3940,7 @@ void TeensyDmx::handleByte(uint8_t c)
               // We're not interested in DUB preamble bytes, so don't store them
               // Start storing at index 8 so we can use DiscUniqueBranchResponse struct
               m_dmxBufferIndex = RDM_DUB_PREAMBLE_SIZE;
+              m_rdmRunningChecksum = 0;
               m_state = State::RDM_DUB_RECV;
             } else if (c == 0xFE) {
               // Serial.println("DUB preamble 0xfe");
@@ -2453,6 +3962,7 @@ void TeensyDmx::handleByte(uint8_t c)
             // Serial.print("DUB recv ");
             // Serial.println(c, HEX);
             reinterpret_cast<uint8_t*>(&m_rdmBuffer)[m_dmxBufferIndex] = c;
+            m_rdmRunningChecksum += c;
             ++m_dmxBufferIndex;
             if (m_dmxBufferIndex >=
                 (sizeof(DiscUniqueBranchResponse) -
@@ -2483,21 +3993,17 @@ void TeensyDmx::handleByte(uint8_t c)
         case State::RDM_DUB_CHECKSUM_0:
             // Serial.print("DUB Check 0, RDM: ");
             // Serial.print(m_rdmResponseDue);
-            // Serial.print(", Disc: ");
-            // Serial.print(m_nextDiscoveryAction);
             // Serial.print(", millis: ");
             // Serial.println(millis());
             m_rdmChecksum = ((m_rdmChecksum & 0xff00) | ((m_rdmChecksum & 0x00ff) & c));
             ++m_dmxBufferIndex;
-            if (m_rdmChecksum ==
-                    rdmCalculateChecksum(
-                        (reinterpret_cast<uint8_t*>(&m_rdmBuffer) +
-                         RDM_DUB_PREAMBLE_SIZE),
-                        sizeof(((DiscUniqueBranchResponse *)0)->maskedDevID))) {
+            if (m_rdmChecksum == m_rdmRunningChecksum) {
                 m_rdmNeedsProcessing = true;
             } else {
                 // Serial.println("DUB Check mismatch");
-                // Assume a checksum mismatch means a collision
+                // Assume a checksum mismatch means a collision, but one
+                // where we got every byte so may be able to decode it
+                m_dubResponseComplete = true;
                 m_controllerState = ControllerState::RDM_DUB_COLLISION;
                 m_rdmNeedsProcessing = true;
             }
@@ -2509,10 +4015,14 @@ void TeensyDmx::handleByte(uint8_t c)
             // Collision/ignore as it's too long?
             m_state = State::IDLE;
             break;
+#endif
         case State::DMX_RECV:
-            m_activeBuffer[m_dmxBufferIndex] = c;
+            // Only the receive window is stored, and we're done once past it
+            if (m_dmxBufferIndex >= m_rxWindowStart && m_dmxBufferIndex < m_rxWindowEnd) {
+                m_activeBuffer[m_dmxBufferIndex - m_rxWindowStart] = c;
+            }
             ++m_dmxBufferIndex;
-            if (m_dmxBufferIndex >= DMX_BUFFER_SIZE) {
+            if (m_dmxBufferIndex >= m_rxWindowEnd) {
                 m_state = State::DMX_COMPLETE;
             }
             break;
@@ -2524,17 +4034,775 @@ void TeensyDmx::handleByte(uint8_t c)
 
 void TeensyDmx::loop()
 {
+    ProfileScope profile(this, PROFILE_LOOP);
+#if TEENSYDMX_RDM_CONTROLLER
     if (m_mode == DMX_OUT) {
         maybeTimeoutRDMMessage();
-        maybeProgressRDMDiscovery();
     }
+#endif
+#if TEENSYDMX_RDM
     if (m_rdmNeedsProcessing)
     {
         m_rdmNeedsProcessing = false;
+#if TEENSYDMX_RDM_CONTROLLER
         if (m_mode == DMX_OUT) {
+            ProfileScope rdmProfile(this, PROFILE_CONTROLLER_RDM);
             processControllerRDM();
-        } else {
+        }
+#endif
+#if TEENSYDMX_RDM_RESPONDER
+        if (m_mode != DMX_OUT) {
+            ProfileScope rdmProfile(this, PROFILE_RESPONDER_RDM);
             processResponderRDM();
         }
+#endif
+    }
+#endif
+#if TEENSYDMX_RDM_CONTROLLER
+    if (m_mode == DMX_OUT) {
+        maybeResumeDmx();
+        // Discovery and queued requests take turns, so requests for devices
+        // already found aren't held up until discovery finishes
+        maybeStartIncrementalDiscovery();
+        if (m_queueTurn) {
+            maybeSendQueuedRDMRequest();
+            maybeProgressRDMDiscovery();
+        } else {
+            maybeProgressRDMDiscovery();
+            maybeSendQueuedRDMRequest();
+        }
+    }
+#endif
+}
+
+RdmResponse::Type RdmResponse::getType() const
+{
+    if (m_data == nullptr) {
+        return RESPONSE_NONE;
     }
+    switch (m_data->responseType)
+    {
+        case E120_RESPONSE_TYPE_ACK:
+            return RESPONSE_ACK;
+        case E120_RESPONSE_TYPE_ACK_TIMER:
+            return RESPONSE_ACK_TIMER;
+        case E120_RESPONSE_TYPE_NACK_REASON:
+            return RESPONSE_NACK;
+        case E120_RESPONSE_TYPE_ACK_OVERFLOW:
+            return RESPONSE_ACK_OVERFLOW;
+        default:
+            return RESPONSE_NONE;
+    }
+}
+
+uint16_t RdmResponse::getNackReason() const
+{
+    return readUInt16(0);
+}
+
+uint32_t RdmResponse::getAckTimerDelay() const
+{
+    // Sent in tenths of a second
+    return readUInt16(0) * 100UL;
+}
+
+const byte* RdmResponse::getSourceUid() const
+{
+    return (m_data != nullptr) ? m_data->sourceId : nullptr;
 }
+
+uint8_t RdmResponse::getTransactionNumber() const
+{
+    return (m_data != nullptr) ? m_data->transNo : 0;
+}
+
+uint8_t RdmResponse::getMessageCount() const
+{
+    return (m_data != nullptr) ? m_data->messageCount : 0;
+}
+
+uint16_t RdmResponse::getSubDevice() const
+{
+    return (m_data != nullptr) ? swapUInt16(m_data->subDev) : 0;
+}
+
+uint8_t RdmResponse::getCommandClass() const
+{
+    return (m_data != nullptr) ? m_data->cmdClass : 0;
+}
+
+uint16_t RdmResponse::getPid() const
+{
+    return (m_data != nullptr) ? swapUInt16(m_data->parameter) : 0;
+}
+
+uint8_t RdmResponse::getDataLength() const
+{
+    return (m_data != nullptr) ? m_data->dataLength : 0;
+}
+
+const byte* RdmResponse::getData() const
+{
+    return (m_data != nullptr) ? m_data->data : nullptr;
+}
+
+uint8_t RdmResponse::readUInt8(uint8_t offset) const
+{
+    if ((offset + 1) > getDataLength()) {
+        return 0;
+    }
+    return m_data->data[offset];
+}
+
+uint16_t RdmResponse::readUInt16(uint8_t offset) const
+{
+    if ((offset + 2) > getDataLength()) {
+        return 0;
+    }
+    return getUInt16(&m_data->data[offset]);
+}
+
+uint32_t RdmResponse::readUInt32(uint8_t offset) const
+{
+    if ((offset + 4) > getDataLength()) {
+        return 0;
+    }
+    return (static_cast<uint32_t>(getUInt16(&m_data->data[offset])) << 16) |
+        getUInt16(&m_data->data[offset + 2]);
+}
+
+const char* RdmResponse::readString(uint8_t offset) const
+{
+    if (offset > getDataLength()) {
+        return "";
+    }
+    return reinterpret_cast<const char*>(&m_data->data[offset]);
+}
+
+uint8_t RdmResponse::stringLength(uint8_t offset) const
+{
+    if (offset > getDataLength()) {
+        return 0;
+    }
+    uint8_t length = getDataLength() - offset;
+    if (length > RDM_MAX_STRING_LENGTH) {
+        length = RDM_MAX_STRING_LENGTH;
+    }
+    // Some devices null terminate their strings anyway
+    const char *string = readString(offset);
+    for (uint8_t i = 0; i < length; ++i) {
+        if (string[i] == '\0') {
+            return i;
+        }
+    }
+    return length;
+}
+
+uint8_t RdmResponse::copyString(uint8_t offset, char *buffer, uint8_t bufferLength) const
+{
+    if (bufferLength == 0) {
+        return 0;
+    }
+    uint8_t length = stringLength(offset);
+    if (length >= bufferLength) {
+        length = bufferLength - 1;
+    }
+    memcpy(buffer, readString(offset), length);
+    buffer[length] = '\0';
+    return length;
+}
+
+namespace {
+
+bool isAckFor(const RdmResponse& response, uint16_t pid, uint8_t minLength)
+{
+    return response.isAck() && response.getPid() == pid &&
+        response.getDataLength() >= minLength;
+}
+
+}  // anon namespace
+
+bool RdmDeviceInfoView::isValid() const
+{
+    return isAckFor(m_response, E120_DEVICE_INFO, sizeof(DeviceInfoGetResponse));
+}
+
+bool RdmLabelView::isValid() const
+{
+    if (!m_response.isAck()) {
+        return false;
+    }
+    switch (m_response.getPid())
+    {
+        case E120_MANUFACTURER_LABEL:
+        case E120_DEVICE_MODEL_DESCRIPTION:
+        case E120_DEVICE_LABEL:
+        case E120_SOFTWARE_VERSION_LABEL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool RdmPersonalityView::isValid() const
+{
+    return isAckFor(m_response, E120_DMX_PERSONALITY, sizeof(DmxPersonalityGetResponse));
+}
+
+bool RdmPersonalityDescriptionView::isValid() const
+{
+    return isAckFor(m_response, E120_DMX_PERSONALITY_DESCRIPTION, 3);
+}
+
+bool RdmSelfTestDescriptionView::isValid() const
+{
+    return isAckFor(m_response, E120_SELF_TEST_DESCRIPTION, 1);
+}
+
+bool RdmSensorDefinitionView::isValid() const
+{
+    return isAckFor(m_response, E120_SENSOR_DEFINITION, 13);
+}
+
+bool RdmSensorValueView::isValid() const
+{
+    return isAckFor(m_response, E120_SENSOR_VALUE, sizeof(SensorValueGetResponse));
+}
+
+#if TEENSYDMX_RDM_CONTROLLER
+RdmInventory::RdmInventory(TeensyDmx& dmx, RdmInventoryCallback callback) :
+    m_dmx(dmx),
+    m_callback(callback),
+    m_slots(),
+    m_deviceCount(0),
+    // Make sure the first loop() picks up the UIDs
+    m_uidVersion(dmx.getRDMUidVersion() - 1),
+    m_fieldsWanted(0),
+    m_fieldsPending(0),
+    m_nextSlot(0),
+    m_completeReported(true)
+{ }
+
+void RdmInventory::loop()
+{
+    if (m_uidVersion != m_dmx.getRDMUidVersion()) {
+        m_uidVersion = m_dmx.getRDMUidVersion();
+        syncWithUids();
+    }
+    queueFetches();
+}
+
+void RdmInventory::refresh()
+{
+    for (uint16_t i = 0; i < CAPACITY; ++i) {
+        Slot& slot = m_slots[i];
+        if (slot.used) {
+            // A field with a GET in flight gets fresh data from that reply,
+            // asking again would count it pending twice
+            uint8_t wanted = slot.wanted | (FIELDS_ALL & ~slot.pending);
+            m_fieldsWanted += __builtin_popcount(wanted) - __builtin_popcount(slot.wanted);
+            slot.wanted = wanted;
+            slot.changed = false;
+        }
+    }
+    if (m_fieldsWanted > 0) {
+        m_completeReported = false;
+    }
+}
+
+uint16_t RdmInventory::getDeviceCount() const
+{
+    return m_deviceCount;
+}
+
+const RdmDeviceRecord* RdmInventory::getDevice(uint16_t slot) const
+{
+    if (slot >= CAPACITY || !m_slots[slot].used) {
+        return nullptr;
+    }
+    return &m_slots[slot].record;
+}
+
+const RdmDeviceRecord* RdmInventory::findDevice(const byte *uid) const
+{
+    for (uint16_t i = 0; i < CAPACITY; ++i) {
+        if (m_slots[i].used &&
+                memcmp(m_slots[i].record.uid, uid, RDM_UID_LENGTH) == 0) {
+            return &m_slots[i].record;
+        }
+    }
+    return nullptr;
+}
+
+bool RdmInventory::isComplete() const
+{
+    return m_fieldsWanted == 0 && m_fieldsPending == 0;
+}
+
+RdmInventory::Slot* RdmInventory::findSlot(const byte *uid)
+{
+    for (uint16_t i = 0; i < CAPACITY; ++i) {
+        if (m_slots[i].used &&
+                memcmp(m_slots[i].record.uid, uid, RDM_UID_LENGTH) == 0) {
+            return &m_slots[i];
+        }
+    }
+    return nullptr;
+}
+
+void RdmInventory::syncWithUids()
+{
+    const RdmUidSet& uids = m_dmx.getRDMUids();
+    // Drop anything discovery no longer knows about
+    for (uint16_t i = 0; i < CAPACITY; ++i) {
+        Slot& slot = m_slots[i];
+        if (slot.used && !uids.contains(slot.record.uid)) {
+            m_fieldsWanted -= __builtin_popcount(slot.wanted);
+            m_fieldsPending -= __builtin_popcount(slot.pending);
+            slot.used = false;
+            // Any responses still to come are for the old device
+            ++slot.generation;
+            --m_deviceCount;
+            if (m_callback != nullptr) {
+                m_callback(RdmInventoryEvent::INVENTORY_DEVICE_REMOVED, &slot.record);
+            }
+        }
+    }
+    // And add anything new
+    uint16_t freeSlot = 0;
+    for (uint16_t i = 0; i < uids.count(); ++i) {
+        if (findSlot(uids.get(i)) != nullptr) {
+            continue;
+        }
+        while (freeSlot < CAPACITY && m_slots[freeSlot].used) {
+            ++freeSlot;
+        }
+        if (freeSlot >= CAPACITY) {
+            // No room for any more
+            break;
+        }
+        Slot& slot = m_slots[freeSlot];
+        uint8_t generation = slot.generation;
+        memset(&slot, 0, sizeof(slot));
+        memcpy(slot.record.uid, uids.get(i), RDM_UID_LENGTH);
+        slot.generation = generation;
+        slot.used = true;
+        slot.wanted = FIELDS_ALL;
+        m_fieldsWanted += FIELD_COUNT;
+        m_completeReported = false;
+        ++m_deviceCount;
+    }
+}
+
+void RdmInventory::queueFetches()
+{
+    static const uint16_t FIELD_PIDS[FIELD_COUNT] = {
+        E120_DEVICE_INFO, E120_MANUFACTURER_LABEL,
+        E120_DEVICE_MODEL_DESCRIPTION, E120_DEVICE_LABEL
+    };
+    // Keep the queue topped up so the next GET is ready as soon as the
+    // bus is free
+    uint16_t skipped = 0;
+    while (m_fieldsWanted > 0 && skipped < CAPACITY &&
+           m_dmx.getRDMQueueLength() < TeensyDmx::MAX_RDM_REQUEST_QUEUE) {
+        Slot& slot = m_slots[m_nextSlot];
+        if (!slot.used || slot.wanted == 0) {
+            m_nextSlot = (m_nextSlot + 1) % CAPACITY;
+            ++skipped;
+            continue;
+        }
+        skipped = 0;
+        uint8_t field = 0;
+        while (!(slot.wanted & (1 << field))) {
+            ++field;
+        }
+        uint32_t tag = m_nextSlot | (static_cast<uint32_t>(field) << 16) |
+                       (static_cast<uint32_t>(slot.generation) << 24);
+        if (!m_dmx.queueRDMRequest(slot.record.uid, E120_GET_COMMAND, FIELD_PIDS[field],
+                                   nullptr, 0, &RdmInventory::handleResponse, this, tag)) {
+            break;
+        }
+        slot.wanted &= ~(1 << field);
+        slot.pending |= (1 << field);
+        --m_fieldsWanted;
+        ++m_fieldsPending;
+        if (slot.wanted == 0) {
+            m_nextSlot = (m_nextSlot + 1) % CAPACITY;
+        }
+    }
+}
+
+void RdmInventory::handleResponse(CallbackStatus status, const RdmResponse& response,
+                                  void *context, uint32_t tag)
+{
+    RdmInventory *inventory = static_cast<RdmInventory*>(context);
+    uint16_t slotIndex = tag & 0xffff;
+    Field field = static_cast<Field>((tag >> 16) & 0xff);
+    uint8_t generation = (tag >> 24) & 0xff;
+    if (slotIndex >= CAPACITY) {
+        return;
+    }
+    Slot& slot = inventory->m_slots[slotIndex];
+    if (!slot.used || slot.generation != generation) {
+        // The device went away while we were asking
+        return;
+    }
+    inventory->processResponse(slot, field, status, response);
+}
+
+namespace {
+
+// Copy an RDM string into a null terminated buffer, returning true if it changed
+bool copyLabel(char *label, const RdmLabelView& view)
+{
+    uint8_t length = view.length();
+    bool changed = (strncmp(label, view.label(), length) != 0) ||
+                   (label[length] != '\0');
+    memcpy(label, view.label(), length);
+    label[length] = '\0';
+    return changed;
+}
+
+}  // anon namespace
+
+void RdmInventory::processResponse(Slot& slot, Field field, CallbackStatus status,
+                                   const RdmResponse& response)
+{
+    slot.pending &= ~(1 << field);
+    --m_fieldsPending;
+    // Anything but an ACK, for instance a NACK for an unsupported label,
+    // just leaves the field as it was
+    if (status == CallbackStatus::CB_SUCCESS) {
+        RdmDeviceRecord& record = slot.record;
+        RdmDeviceInfoView info(response);
+        RdmLabelView label(response);
+        switch (field)
+        {
+            case FIELD_DEVICE_INFO:
+                if (info.isValid()) {
+                    RdmDeviceRecord previous = record;
+                    record.deviceModelId = info.deviceModelId();
+                    record.productCategory = info.productCategory();
+                    record.softwareVersionId = info.softwareVersionId();
+                    record.footprint = info.footprint();
+                    record.currentPersonality = info.currentPersonality();
+                    record.personalityCount = info.personalityCount();
+                    record.startAddress = info.startAddress();
+                    record.subDeviceCount = info.subDeviceCount();
+                    record.sensorCount = info.sensorCount();
+                    if (memcmp(&previous, &record, sizeof(record)) != 0) {
+                        slot.changed = true;
+                    }
+                }
+                break;
+            case FIELD_MANUFACTURER_LABEL:
+                if (label.isValid()) {
+                    slot.changed |= copyLabel(record.manufacturerLabel, label);
+                }
+                break;
+            case FIELD_DEVICE_MODEL:
+                if (label.isValid()) {
+                    slot.changed |= copyLabel(record.deviceModel, label);
+                }
+                break;
+            case FIELD_DEVICE_LABEL:
+                if (label.isValid()) {
+                    slot.changed |= copyLabel(record.deviceLabel, label);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    maybeReport(slot);
+}
+
+void RdmInventory::maybeReport(Slot& slot)
+{
+    if (slot.wanted != 0 || slot.pending != 0) {
+        return;
+    }
+    if (!slot.ready) {
+        slot.ready = true;
+        if (m_callback != nullptr) {
+            m_callback(RdmInventoryEvent::INVENTORY_DEVICE_READY, &slot.record);
+        }
+    } else if (slot.changed && m_callback != nullptr) {
+        m_callback(RdmInventoryEvent::INVENTORY_DEVICE_CHANGED, &slot.record);
+    }
+    slot.changed = false;
+    if (isComplete() && !m_completeReported) {
+        m_completeReported = true;
+        if (m_callback != nullptr) {
+            m_callback(RdmInventoryEvent::INVENTORY_COMPLETE, nullptr);
+        }
+    }
+}
+
+RdmPoller::RdmPoller(TeensyDmx& dmx, RdmPollCallback callback) :
+    m_dmx(dmx),
+    m_callback(callback),
+    m_subscriptions(),
+    m_subscriptionCount(0),
+    m_pollSpacing(DEFAULT_POLL_SPACING),
+    m_lastPoll(millis()),
+    m_pollInFlight(false)
+{ }
+
+int16_t RdmPoller::subscribe(const byte *uid, uint16_t pid, uint32_t interval,
+                             const byte *param, uint8_t paramLength)
+{
+    if (uid == nullptr || paramLength > MAX_PARAM_LENGTH ||
+            (paramLength > 0 && param == nullptr)) {
+        return -1;
+    }
+    int16_t freeIndex = -1;
+    for (int16_t i = 0; i < CAPACITY; ++i) {
+        Subscription& subscription = m_subscriptions[i];
+        if (subscription.references == 0) {
+            if (freeIndex < 0) {
+                freeIndex = i;
+            }
+        } else if (subscription.pid == pid && subscription.paramLength == paramLength &&
+                   memcmp(subscription.uid, uid, RDM_UID_LENGTH) == 0 &&
+                   memcmp(subscription.param, param, paramLength) == 0) {
+            // Coalesce, one poll serves both
+            if (subscription.references == 0xff) {
+                return -1;
+            }
+            ++subscription.references;
+            if (interval < subscription.interval) {
+                subscription.interval = interval;
+            }
+            return i;
+        }
+    }
+    if (freeIndex < 0) {
+        return -1;
+    }
+    Subscription& subscription = m_subscriptions[freeIndex];
+    uint8_t generation = subscription.generation + 1;
+    memset(&subscription, 0, sizeof(subscription));
+    memcpy(subscription.uid, uid, RDM_UID_LENGTH);
+    subscription.pid = pid;
+    if (paramLength > 0) {
+        memcpy(subscription.param, param, paramLength);
+    }
+    subscription.paramLength = paramLength;
+    subscription.references = 1;
+    subscription.generation = generation;
+    subscription.interval = interval;
+    // Stagger first polls by the spacing, so a batch of subscriptions made
+    // together doesn't all come due at once
+    subscription.due = millis() + (m_subscriptionCount * m_pollSpacing);
+    ++m_subscriptionCount;
+    return freeIndex;
+}
+
+int16_t RdmPoller::subscribeSensorValue(const byte *uid, uint8_t sensor, uint32_t interval)
+{
+    return subscribe(uid, E120_SENSOR_VALUE, interval, &sensor, sizeof(sensor));
+}
+
+int16_t RdmPoller::subscribeLampState(const byte *uid, uint32_t interval)
+{
+    return subscribe(uid, E120_LAMP_STATE, interval);
+}
+
+bool RdmPoller::unsubscribe(int16_t subscription)
+{
+    if (subscription < 0 || subscription >= CAPACITY ||
+            m_subscriptions[subscription].references == 0) {
+        return false;
+    }
+    if (--m_subscriptions[subscription].references == 0) {
+        --m_subscriptionCount;
+    }
+    return true;
+}
+
+uint16_t RdmPoller::getSubscriptionCount() const
+{
+    return m_subscriptionCount;
+}
+
+void RdmPoller::setPollSpacing(uint32_t spacing)
+{
+    m_pollSpacing = spacing;
+}
+
+void RdmPoller::resetChanges()
+{
+    for (uint16_t i = 0; i < CAPACITY; ++i) {
+        m_subscriptions[i].reported = false;
+    }
+}
+
+int16_t RdmPoller::findDuePoll(uint32_t now) const
+{
+    // The most overdue subscription goes first
+    int16_t due = -1;
+    int32_t dueLate = 0;
+    for (int16_t i = 0; i < CAPACITY; ++i) {
+        const Subscription& subscription = m_subscriptions[i];
+        if (subscription.references == 0) {
+            continue;
+        }
+        int32_t late = static_cast<int32_t>(now - subscription.due);
+        if (late >= 0 && (due < 0 || late > dueLate)) {
+            due = i;
+            dueLate = late;
+        }
+    }
+    return due;
+}
+
+void RdmPoller::loop()
+{
+    if (m_pollInFlight || m_subscriptionCount == 0) {
+        return;
+    }
+    uint32_t now = millis();
+    if ((now - m_lastPoll) < m_pollSpacing) {
+        return;
+    }
+    int16_t index = findDuePoll(now);
+    if (index < 0) {
+        return;
+    }
+    Subscription& subscription = m_subscriptions[index];
+    uint32_t tag = index | (static_cast<uint32_t>(subscription.generation) << 16);
+    if (!m_dmx.queueRDMRequest(subscription.uid, E120_GET_COMMAND, subscription.pid,
+                               subscription.param, subscription.paramLength,
+                               &RdmPoller::handleResponse, this, tag)) {
+        return;
+    }
+    m_pollInFlight = true;
+    m_lastPoll = now;
+    subscription.due += subscription.interval;
+    if (static_cast<int32_t>(now - subscription.due) >= 0) {
+        // Too far behind to catch up, don't poll in a burst
+        subscription.due = now + subscription.interval;
+    }
+}
+
+void RdmPoller::handleResponse(CallbackStatus status, const RdmResponse& response,
+                               void *context, uint32_t tag)
+{
+    RdmPoller *poller = static_cast<RdmPoller*>(context);
+    poller->m_pollInFlight = false;
+    int16_t index = tag & 0xffff;
+    uint8_t generation = (tag >> 16) & 0xff;
+    if (index >= CAPACITY) {
+        return;
+    }
+    const Subscription& subscription = poller->m_subscriptions[index];
+    if (subscription.references == 0 || subscription.generation != generation) {
+        // Unsubscribed while we were asking
+        return;
+    }
+    poller->processResponse(index, status, response);
+}
+
+void RdmPoller::processResponse(int16_t index, CallbackStatus status,
+                                const RdmResponse& response)
+{
+    Subscription& subscription = m_subscriptions[index];
+    // The data of a NACK is its reason, so comparing the data covers both
+    uint8_t length = response.getDataLength();
+    bool kept = length <= MAX_VALUE_LENGTH;
+    if (subscription.reported && kept && status == subscription.lastStatus &&
+            response.getType() == subscription.lastType &&
+            length == subscription.lastLength &&
+            (length == 0 || memcmp(response.getData(), subscription.lastValue, length) == 0)) {
+        return;
+    }
+    subscription.reported = kept;
+    subscription.lastStatus = status;
+    subscription.lastType = response.getType();
+    subscription.lastLength = length;
+    if (kept && length > 0) {
+        memcpy(subscription.lastValue, response.getData(), length);
+    }
+    if (m_callback != nullptr) {
+        m_callback(index, subscription.uid, subscription.pid, status, response);
+    }
+}
+
+TeensyDmxManager::TeensyDmxManager() :
+    m_ports{nullptr},
+    m_portCount(0),
+    m_nextPort(0)
+{ }
+
+bool TeensyDmxManager::addPort(TeensyDmx& port)
+{
+    if (m_portCount >= MAX_PORTS) {
+        return false;
+    }
+    m_ports[m_portCount++] = &port;
+    return true;
+}
+
+uint8_t TeensyDmxManager::getPortCount() const
+{
+    return m_portCount;
+}
+
+TeensyDmx* TeensyDmxManager::getPort(uint8_t index)
+{
+    return (index < m_portCount) ? m_ports[index] : nullptr;
+}
+
+void TeensyDmxManager::setMode(TeensyDmx::Mode mode)
+{
+    for (uint8_t i = 0; i < m_portCount; ++i) {
+        m_ports[i]->setMode(mode);
+    }
+}
+
+void TeensyDmxManager::doRDMDiscovery()
+{
+    for (uint8_t i = 0; i < m_portCount; ++i) {
+        m_ports[i]->doRDMDiscovery();
+    }
+}
+
+void TeensyDmxManager::doRDMIncrementalDiscovery()
+{
+    for (uint8_t i = 0; i < m_portCount; ++i) {
+        m_ports[i]->doRDMIncrementalDiscovery();
+    }
+}
+
+void TeensyDmxManager::doRDMWarmStartDiscovery()
+{
+    for (uint8_t i = 0; i < m_portCount; ++i) {
+        m_ports[i]->doRDMWarmStartDiscovery();
+    }
+}
+
+bool TeensyDmxManager::isRDMIdle() const
+{
+    for (uint8_t i = 0; i < m_portCount; ++i) {
+        if (!m_ports[i]->isRDMIdle()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void TeensyDmxManager::loop()
+{
+    if (m_portCount == 0) {
+        return;
+    }
+    // Requests go out from the TX interrupt, so each port's loop() only
+    // starts the next step and returns. While one line waits out a response
+    // window the others are sending.
+    for (uint8_t i = 0; i < m_portCount; ++i) {
+        m_ports[(m_nextPort + i) % m_portCount]->loop();
+    }
+    m_nextPort = (m_nextPort + 1) % m_portCount;
+}
+#endif
@@ -30,15 +30,106 @@
 
 #include "Arduino.h"
 
-enum { DMX_BUFFER_SIZE = 512 };
+// Slots in a full DMX universe, and the fewest a transmitted frame may have
+enum { DMX_UNIVERSE_SIZE = 512 };
+enum { DMX_MIN_TX_SLOTS = 24 };
 enum { RDM_UID_LENGTH = 6 };
 enum { RDM_MAX_STRING_LENGTH = 32 };
 enum { RDM_MAX_PARAMETER_DATA_LENGTH = 231 };
+// Largest parameter data we'll hold for a queued controller request
+enum { RDM_MAX_REQUEST_DATA_LENGTH = RDM_MAX_STRING_LENGTH };
 enum { RDM_ROOT_DEVICE = 0 };
 enum { RDM_MIN_LOWER_BOUND_UID = 0x0000000000000000 };
 enum { RDM_MAX_UPPER_BOUND_UID = 0x00007fffffffffff };
 
-enum CallbackStatus { CB_SUCCESS, CB_RDM_BROADCAST, CB_RDM_TIMEOUT, CB_RDM_CHECKSUM_ERROR };
+// Which parts of the library are built, define TEENSYDMX_FEATURES as one of
+// these before including to leave out what a product doesn't use:
+//   DMX        - DMX in and out only, RDM packets are ignored like any ASC
+//   RESPONDER  - DMX, and answers RDM requests in DMX_IN
+//   CONTROLLER - DMX, and RDM discovery and requests in DMX_OUT
+//   FULL       - both RDM roles, the default
+#define TEENSYDMX_FEATURES_DMX 0
+#define TEENSYDMX_FEATURES_RESPONDER 1
+#define TEENSYDMX_FEATURES_CONTROLLER 2
+#define TEENSYDMX_FEATURES_FULL 3
+#ifndef TEENSYDMX_FEATURES
+#define TEENSYDMX_FEATURES TEENSYDMX_FEATURES_FULL
+#endif
+#if (TEENSYDMX_FEATURES < TEENSYDMX_FEATURES_DMX) || (TEENSYDMX_FEATURES > TEENSYDMX_FEATURES_FULL)
+#error "TEENSYDMX_FEATURES must be one of the TEENSYDMX_FEATURES_ profiles"
+#endif
+#define TEENSYDMX_RDM_RESPONDER ((TEENSYDMX_FEATURES & TEENSYDMX_FEATURES_RESPONDER) != 0)
+#define TEENSYDMX_RDM_CONTROLLER ((TEENSYDMX_FEATURES & TEENSYDMX_FEATURES_CONTROLLER) != 0)
+#define TEENSYDMX_RDM (TEENSYDMX_FEATURES != TEENSYDMX_FEATURES_DMX)
+
+// Slots kept for each DMX buffer, a receiver only stores this many of each
+// frame and DMX_OUT sends this many, padded with zeroes to DMX_MIN_TX_SLOTS
+#ifndef TEENSYDMX_DMX_BUFFER_SIZE
+#define TEENSYDMX_DMX_BUFFER_SIZE DMX_UNIVERSE_SIZE
+#endif
+static_assert((TEENSYDMX_DMX_BUFFER_SIZE > 0) && (TEENSYDMX_DMX_BUFFER_SIZE <= DMX_UNIVERSE_SIZE),
+              "TEENSYDMX_DMX_BUFFER_SIZE must be between 1 and 512");
+enum { DMX_BUFFER_SIZE = TEENSYDMX_DMX_BUFFER_SIZE };
+
+// Number of UIDs discovery can hold. It sets the size of TeensyDmx, so set
+// it with a build flag (build_flags or platform.local.txt) so the library
+// sees the same value as the sketch
+#ifndef TEENSYDMX_MAX_RDM_UIDS
+#define TEENSYDMX_MAX_RDM_UIDS 128
+#endif
+static_assert((TEENSYDMX_MAX_RDM_UIDS > 0) && (TEENSYDMX_MAX_RDM_UIDS <= DMX_UNIVERSE_SIZE),
+              "TEENSYDMX_MAX_RDM_UIDS must be between 1 and 512");
+
+// Define TEENSYDMX_PROFILING to time the interrupt handlers and loop()
+// stages with the DWT cycle counter, see getProfileStats()
+#if defined(TEENSYDMX_PROFILING) && defined(KINETISL)
+#error "TEENSYDMX_PROFILING needs the DWT cycle counter, which Teensy-LC doesn't have"
+#endif
+
+// Number of requests the controller can have queued, including the one in
+// flight
+#ifndef TEENSYDMX_MAX_RDM_REQUESTS
+#define TEENSYDMX_MAX_RDM_REQUESTS 8
+#endif
+static_assert((TEENSYDMX_MAX_RDM_REQUESTS > 0) && (TEENSYDMX_MAX_RDM_REQUESTS <= 0xff),
+              "TEENSYDMX_MAX_RDM_REQUESTS must be between 1 and 255");
+
+// Number of requests the controller can hold waiting on an ACK_TIMER
+#ifndef TEENSYDMX_MAX_RDM_DEFERRED
+#define TEENSYDMX_MAX_RDM_DEFERRED 4
+#endif
+static_assert((TEENSYDMX_MAX_RDM_DEFERRED > 0) && (TEENSYDMX_MAX_RDM_DEFERRED <= 0x7f),
+              "TEENSYDMX_MAX_RDM_DEFERRED must be between 1 and 127");
+
+// Number of GET responses the controller keeps to answer repeat requests
+#ifndef TEENSYDMX_RDM_CACHE_SIZE
+#define TEENSYDMX_RDM_CACHE_SIZE 16
+#endif
+static_assert((TEENSYDMX_RDM_CACHE_SIZE > 0), "TEENSYDMX_RDM_CACHE_SIZE must be at least 1");
+
+// Number of devices an RdmInventory can hold records for
+#ifndef TEENSYDMX_MAX_RDM_DEVICES
+#define TEENSYDMX_MAX_RDM_DEVICES TEENSYDMX_MAX_RDM_UIDS
+#endif
+static_assert((TEENSYDMX_MAX_RDM_DEVICES > 0) && (TEENSYDMX_MAX_RDM_DEVICES <= DMX_UNIVERSE_SIZE),
+              "TEENSYDMX_MAX_RDM_DEVICES must be between 1 and 512");
+
+// Number of subscriptions an RdmPoller can hold
+#ifndef TEENSYDMX_MAX_RDM_POLLS
+#define TEENSYDMX_MAX_RDM_POLLS 16
+#endif
+static_assert((TEENSYDMX_MAX_RDM_POLLS > 0) && (TEENSYDMX_MAX_RDM_POLLS <= 0x7fff),
+              "TEENSYDMX_MAX_RDM_POLLS must be between 1 and 32767");
+
+// Number of devices the controller keeps reliability statistics for
+#ifndef TEENSYDMX_MAX_RDM_DEVICE_STATS
+#define TEENSYDMX_MAX_RDM_DEVICE_STATS 32
+#endif
+static_assert((TEENSYDMX_MAX_RDM_DEVICE_STATS > 0) && (TEENSYDMX_MAX_RDM_DEVICE_STATS <= 0xff),
+              "TEENSYDMX_MAX_RDM_DEVICE_STATS must be between 1 and 255");
+
+enum CallbackStatus { CB_SUCCESS, CB_RDM_BROADCAST, CB_RDM_TIMEOUT, CB_RDM_CHECKSUM_ERROR,
+                      CB_RDM_UID_OVERFLOW, CB_RDM_CACHED };
 
 struct RdmData
 {
@@ -62,8 +153,262 @@ static_assert((sizeof(RdmData) == 255),
 
 using RdmControllerCallback = void(*)(CallbackStatus, RdmData*);
 
+// A view of a controller response which decodes the big-endian fields in
+// place. Like the views below it's only valid during the callback it was
+// passed to.
+class RdmResponse
+{
+  public:
+    enum Type { RESPONSE_NONE, RESPONSE_ACK, RESPONSE_ACK_TIMER, RESPONSE_NACK,
+                RESPONSE_ACK_OVERFLOW };
+
+    explicit RdmResponse(const RdmData *data) : m_data(data) { }
+
+    // RESPONSE_NONE for timeouts, checksum errors and broadcasts
+    Type getType() const;
+    bool isAck() const { return getType() == RESPONSE_ACK; }
+    // Only meaningful for RESPONSE_NACK
+    uint16_t getNackReason() const;
+    // Only meaningful for RESPONSE_ACK_TIMER, in milliseconds
+    uint32_t getAckTimerDelay() const;
+
+    const byte* getSourceUid() const;
+    uint8_t getTransactionNumber() const;
+    uint8_t getMessageCount() const;
+    uint16_t getSubDevice() const;
+    uint8_t getCommandClass() const;
+    uint16_t getPid() const;
+    uint8_t getDataLength() const;
+    const byte* getData() const;
+    // The raw packet, nullptr if there wasn't one
+    const RdmData* getRaw() const { return m_data; }
+
+    // Big-endian reads from the parameter data, 0 if past the end
+    uint8_t readUInt8(uint8_t offset) const;
+    uint16_t readUInt16(uint8_t offset) const;
+    uint32_t readUInt32(uint8_t offset) const;
+    // A string running from offset to the end of the parameter data, it's
+    // not null terminated
+    const char* readString(uint8_t offset) const;
+    uint8_t stringLength(uint8_t offset) const;
+    // Copy the string into buffer with a null, returns the length copied
+    uint8_t copyString(uint8_t offset, char *buffer, uint8_t bufferLength) const;
+
+  private:
+    const RdmData *m_data;
+};
+
+// Views over an ACK for a particular PID, isValid() checks the response is
+// an ACK for that PID with enough data
+class RdmDeviceInfoView
+{
+  public:
+    explicit RdmDeviceInfoView(const RdmResponse& response) : m_response(response) { }
+    bool isValid() const;
+    uint16_t protocolVersion() const { return m_response.readUInt16(0); }
+    uint16_t deviceModelId() const { return m_response.readUInt16(2); }
+    uint16_t productCategory() const { return m_response.readUInt16(4); }
+    uint32_t softwareVersionId() const { return m_response.readUInt32(6); }
+    uint16_t footprint() const { return m_response.readUInt16(10); }
+    uint8_t currentPersonality() const { return m_response.readUInt8(12); }
+    uint8_t personalityCount() const { return m_response.readUInt8(13); }
+    uint16_t startAddress() const { return m_response.readUInt16(14); }
+    uint16_t subDeviceCount() const { return m_response.readUInt16(16); }
+    uint8_t sensorCount() const { return m_response.readUInt8(18); }
+
+  private:
+    const RdmResponse& m_response;
+};
+
+// MANUFACTURER_LABEL, DEVICE_MODEL_DESCRIPTION, DEVICE_LABEL and
+// SOFTWARE_VERSION_LABEL
+class RdmLabelView
+{
+  public:
+    explicit RdmLabelView(const RdmResponse& response) : m_response(response) { }
+    bool isValid() const;
+    const char* label() const { return m_response.readString(0); }
+    uint8_t length() const { return m_response.stringLength(0); }
+
+  private:
+    const RdmResponse& m_response;
+};
+
+class RdmPersonalityView
+{
+  public:
+    explicit RdmPersonalityView(const RdmResponse& response) : m_response(response) { }
+    bool isValid() const;
+    uint8_t currentPersonality() const { return m_response.readUInt8(0); }
+    uint8_t personalityCount() const { return m_response.readUInt8(1); }
+
+  private:
+    const RdmResponse& m_response;
+};
+
+class RdmPersonalityDescriptionView
+{
+  public:
+    explicit RdmPersonalityDescriptionView(const RdmResponse& response) : m_response(response) { }
+    bool isValid() const;
+    uint8_t personality() const { return m_response.readUInt8(0); }
+    uint16_t slotsRequired() const { return m_response.readUInt16(1); }
+    const char* description() const { return m_response.readString(3); }
+    uint8_t descriptionLength() const { return m_response.stringLength(3); }
+
+  private:
+    const RdmResponse& m_response;
+};
+
+class RdmSelfTestDescriptionView
+{
+  public:
+    explicit RdmSelfTestDescriptionView(const RdmResponse& response) : m_response(response) { }
+    bool isValid() const;
+    uint8_t testNumber() const { return m_response.readUInt8(0); }
+    const char* description() const { return m_response.readString(1); }
+    uint8_t descriptionLength() const { return m_response.stringLength(1); }
+
+  private:
+    const RdmResponse& m_response;
+};
+
+class RdmSensorDefinitionView
+{
+  public:
+    explicit RdmSensorDefinitionView(const RdmResponse& response) : m_response(response) { }
+    bool isValid() const;
+    uint8_t sensorNumber() const { return m_response.readUInt8(0); }
+    uint8_t type() const { return m_response.readUInt8(1); }
+    uint8_t unit() const { return m_response.readUInt8(2); }
+    uint8_t prefix() const { return m_response.readUInt8(3); }
+    int16_t rangeMin() const { return m_response.readUInt16(4); }
+    int16_t rangeMax() const { return m_response.readUInt16(6); }
+    int16_t normalMin() const { return m_response.readUInt16(8); }
+    int16_t normalMax() const { return m_response.readUInt16(10); }
+    uint8_t recordedValueSupport() const { return m_response.readUInt8(12); }
+    const char* description() const { return m_response.readString(13); }
+    uint8_t descriptionLength() const { return m_response.stringLength(13); }
+
+  private:
+    const RdmResponse& m_response;
+};
+
+class RdmSensorValueView
+{
+  public:
+    explicit RdmSensorValueView(const RdmResponse& response) : m_response(response) { }
+    bool isValid() const;
+    uint8_t sensorNumber() const { return m_response.readUInt8(0); }
+    int16_t presentValue() const { return m_response.readUInt16(1); }
+    int16_t lowestValue() const { return m_response.readUInt16(3); }
+    int16_t highestValue() const { return m_response.readUInt16(5); }
+    int16_t recordedValue() const { return m_response.readUInt16(7); }
+
+  private:
+    const RdmResponse& m_response;
+};
+
+// Called when a queued RDM request completes, context and tag are whatever
+// was passed to queueRDMRequest
+using RdmRequestCallback = void(*)(CallbackStatus, const RdmResponse&, void* context, uint32_t tag);
+
+// Responder latency: microseconds from the end of our request to the start
+// of the response. This is the responder's time, not our own turnaround.
+struct RdmResponderLatencyStats
+{
+    uint32_t count;
+    uint32_t last;
+    uint32_t min;
+    uint32_t max;
+};
+
+// Reliability of the controller's requests to one device. Latency is in
+// microseconds, from the end of a request to the end of its response.
+struct RdmDeviceStats
+{
+    byte uid[RDM_UID_LENGTH];
+    uint32_t requests;  // Sent, including retries
+    uint32_t responses;
+    uint32_t timeouts;
+    uint32_t checksumErrors;
+    uint32_t retries;
+    uint32_t maxLatency;
+    uint64_t totalLatency;
+    uint32_t lastUsed;  // millis() of the last request
+
+    uint32_t meanLatency() const {
+        return (responses > 0) ? static_cast<uint32_t>(totalLatency / responses) : 0;
+    }
+};
+
+// The places timed when built with TEENSYDMX_PROFILING. The interrupt sites
+// include the core's own serial handler, which they call on the way out.
+enum ProfileSite { PROFILE_RX_STATUS, PROFILE_RX_ERROR, PROFILE_TX_STATUS,
+                   PROFILE_LOOP, PROFILE_RESPONDER_RDM, PROFILE_CONTROLLER_RDM,
+                   PROFILE_SITE_COUNT };
+
+enum { PROFILE_HISTOGRAM_BUCKETS = 16 };
+
+// Times in CPU cycles. Bucket n of the histogram counts samples of 2^n to
+// 2^(n+1) - 1 cycles, the last one everything longer too.
+struct ProfileStats
+{
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t total;
+    uint32_t histogram[PROFILE_HISTOGRAM_BUCKETS];
+};
+
+struct RdmDiscoveryStats
+{
+    uint32_t elapsedMicros;  // Time taken by discovery so far
+    uint16_t dubCount;  // DUB requests sent
+    uint16_t collisionCount;  // DUB requests which saw a collision
+    uint16_t decodedCount;  // Collisions narrowed down from the merged response
+    uint16_t rangesRemaining;  // DUB ranges still waiting to be searched
+};
+
+#if TEENSYDMX_RDM_CONTROLLER
+// A sorted set of UIDs, packed as 6 big-endian bytes each so that memcmp
+// order is UID order
+class RdmUidSet
+{
+  public:
+    enum { CAPACITY = TEENSYDMX_MAX_RDM_UIDS };
+    enum Result { UID_ADDED, UID_DUPLICATE, UID_FULL };
+
+    RdmUidSet() : m_uids{0}, m_count(0) { }
+
+    Result insert(const byte *uid);
+    bool contains(const byte *uid) const;
+    void remove(uint16_t index);
+    void clear() { m_count = 0; }
+    uint16_t count() const { return m_count; }
+    bool full() const { return m_count >= CAPACITY; }
+    const byte* get(uint16_t index) const { return &m_uids[index * RDM_UID_LENGTH]; }
+    byte* data() { return m_uids; }
+
+  private:
+    // Index of the first UID not less than uid
+    uint16_t lowerBound(const byte *uid) const;
+
+    byte m_uids[CAPACITY * RDM_UID_LENGTH];
+    uint16_t m_count;
+};
+#endif
+
 using RdmDiscoveryCallback = void(*)(CallbackStatus, byte*, uint32_t);
 
+enum RdmUidEvent { UID_EVENT_ADDED, UID_EVENT_REMOVED };
+
+// Called as each device is found by, or goes missing during, discovery
+using RdmUidEventCallback = void(*)(RdmUidEvent, const byte *uid);
+
+// Called after each DUB response, or lack of one, has been dealt with
+using RdmDiscoveryProgressCallback = void(*)(const RdmDiscoveryStats&);
+
 struct RdmInit
 {
     const byte *uid;
@@ -79,6 +424,8 @@ struct RdmInit
     const uint16_t *additionalCommands;
     RdmDiscoveryCallback discoveryCallback;
     RdmControllerCallback controllerCallback;
+    RdmUidEventCallback uidEventCallback;
+    RdmDiscoveryProgressCallback discoveryProgressCallback;
 };
 
 class TeensyDmx
@@ -105,15 +452,30 @@ class TeensyDmx
 
     // Returns true if a new frame has been received since the this was last called
     bool newFrame();
-    // Get the buffer with the current channel data in
+    // Get the buffer with the current channel data in, when receiving it
+    // starts at the receive window's first slot
     const volatile uint8_t* getBuffer() const;
-    // Use for receive with addresses from 0-511
+    // Use for receive with addresses from 0-511, 0 outside the receive window
     uint8_t getChannel(const uint16_t address);
     // Use for receive with addresses from 1-512
     uint8_t getDmxChannel(const uint16_t address)
     {
         return getChannel(address - 1);
     }
+
+    // Only store length slots from startAddress (0-511) of each received
+    // frame, so the DMX buffers need only be as big as the window, see
+    // TEENSYDMX_DMX_BUFFER_SIZE. The length is capped to the buffer size.
+    void setReceiveWindow(uint16_t startAddress, uint16_t length);
+    // Store the first DMX_BUFFER_SIZE slots again, the default
+    void clearReceiveWindow();
+#if TEENSYDMX_RDM_RESPONDER
+    // Receive just our RdmInit footprint from its start address, moving the
+    // window whenever a controller sets a new start address. Call it again
+    // after changing startAddress or footprint directly.
+    void setReceiveWindowToFootprint();
+#endif
+#if TEENSYDMX_RDM_RESPONDER
     // Returns true if RDM has changed since this was last called
     bool rdmChanged();
     // Returns true if the device should be in identify mode
@@ -121,11 +483,14 @@ class TeensyDmx
     // Returns the user-set label of the device
     // This will always be null terminated, therefore can be up to 33 chars
     const char* getLabel() const;
+#endif
 
+#if TEENSYDMX_RDM
     // Return the comms status error counters
     const volatile uint16_t getShortMessage() const;
     const volatile uint16_t getChecksumFail() const;
     const volatile uint16_t getLengthMismatch() const;
+#endif
 
     // Use for transmit with addresses from 0-511
     // Will keep all other values as they were previously
@@ -147,51 +512,230 @@ class TeensyDmx
         setChannels(startAddress - 1, values, length);
     }
 
+#if TEENSYDMX_RDM_CONTROLLER
     void doRDMDiscovery();
+    // Keep the UIDs we already know, check each is still there with a mute,
+    // then only DUB for devices we haven't seen. Does a full discovery if
+    // we don't know of any devices yet.
+    void doRDMIncrementalDiscovery();
+    // Run an incremental discovery this many milliseconds after the last
+    // discovery finished, 0 to turn it off
+    void setRDMDiscoveryInterval(uint32_t interval);
+
+    // Keep the UID table in EEPROM at this address, it's saved whenever a
+    // discovery changes it. -1 turns it off.
+    void setRDMUidStorage(int address);
+    bool saveRDMUids(int address);
+    bool loadRDMUids(int address);
+    // Load the stored UIDs and report them straight away with CB_RDM_CACHED,
+    // then run an incremental discovery to confirm them and find new devices
+    void doRDMWarmStartDiscovery();
+
+    // Queue an RDM request to be sent as soon as the controller is free.
+    // Requests are sent in order, each with its own transaction number, and
+    // the callback is called with the matching response, a timeout or an
+    // error.  If callback is nullptr the RdmInit controllerCallback is used.
+    // Returns false if the queue is full or the request is invalid.
+    bool queueRDMRequest(const byte *uid, uint8_t commandClass, uint16_t pid,
+                         const byte *data, uint8_t dataLength,
+                         RdmRequestCallback callback = nullptr,
+                         void *context = nullptr, uint32_t tag = 0,
+                         uint16_t subDevice = RDM_ROOT_DEVICE);
+    // The number of requests queued, including any in flight
+    uint8_t getRDMQueueLength() const;
+    // Returns true if there is no discovery, queued or outstanding request
+    bool isRDMIdle() const;
+    // The UIDs found by discovery, and a number which changes whenever
+    // a UID is added to or removed from them
+    const RdmUidSet& getRDMUids() const;
+    uint16_t getRDMUidVersion() const;
+
+    enum { MAX_RDM_REQUEST_QUEUE = TEENSYDMX_MAX_RDM_REQUESTS };
+
+    // A request answered with ACK_TIMER is put aside and followed up with
+    // GET QUEUED_MESSAGE once the device says it's ready, the real response
+    // going to the original callback. That gets CB_RDM_TIMEOUT and no
+    // response if the device never has it ready or NACKs QUEUED_MESSAGE.
+    // Responses advertising queued messages have them fetched and passed to
+    // the RdmInit controllerCallback.
+    enum { MAX_RDM_DEFERRED_REQUESTS = TEENSYDMX_MAX_RDM_DEFERRED };
+    enum { MAX_RDM_FOLLOW_UP_ATTEMPTS = 10 };
+    // Milliseconds before asking again if the device had nothing for us
+    enum { RDM_FOLLOW_UP_RETRY_DELAY = 100 };
+
+    // GETs for slowly changing PIDs (labels, DEVICE_INFO, start address,
+    // personality and the like) are answered from a cache for this many
+    // milliseconds. A SET to the same device and PID throws the cached
+    // response away.
+    enum { RDM_DEFAULT_CACHE_TTL = 10000 };
+    enum { MAX_RDM_CACHE_TTL_OVERRIDES = 8 };
+    // Change how long a PID is cached for, 0 stops it being cached.
+    // Returns false if there's no room for another override.
+    bool setRDMCacheTTL(uint16_t pid, uint32_t ttl);
+    void clearRDMCache();
+    uint32_t getRDMCacheHits() const;
+    uint32_t getRDMCacheMisses() const;
+
+    // GETs, and SETs which can safely be repeated, are sent again if they
+    // time out or the response is corrupted, each retry waiting twice as
+    // long as the last. The callback only sees the final outcome.
+    enum { RDM_DEFAULT_RETRIES = 2 };
+    // Milliseconds before the first retry
+    enum { RDM_DEFAULT_RETRY_BACKOFF = 10 };
+    void setRDMRetries(uint8_t retries, uint32_t backoff = RDM_DEFAULT_RETRY_BACKOFF);
+
+    // Statistics for each device we've sent requests to, the least recently
+    // used device making way for a new one when the table is full
+    uint8_t getRDMDeviceStatsCount() const;
+    const RdmDeviceStats* getRDMDeviceStats(uint8_t index) const;
+    const RdmDeviceStats* findRDMDeviceStats(const byte *uid) const;
+    void clearRDMDeviceStats();
+
+    // All of the sendRDM functions below queue the request, returning false
+    // if it could not be queued, and report back to controllerCallback
+
+    // E1.20 response windows, all in microseconds.  A response must start
+    // within RDM_RESPONSE_TIMEOUT of the end of our request, once it has
+    // started we allow it long enough to complete.
+    enum { RDM_RESPONSE_TIMEOUT = 2800 };
+    // Break, MAB and 257 slots at 44us, plus some inter-slot time
+    enum { RDM_MAX_RESPONSE_DURATION = 12000 };
+    // 24 slots of DUB response with no break, plus some inter-slot time
+    enum { RDM_MAX_DUB_RESPONSE_DURATION = 2900 };
+    enum { RDM_DEFAULT_TIMEOUT_MARGIN = 200 };
+
+    // Extra time in microseconds to allow on top of the E1.20 response
+    // windows, for responders which are slow to turn the line around
+    void setRDMTimeoutMargin(uint32_t margin);
+
+    // In DMX_OUT, requests are sent in the gap after a complete DMX frame
+    // and DMX resumes once the response window has closed, so the universe
+    // keeps running during RDM. This sets how many whole frames are sent
+    // between one transaction and the next, at least one.
+    enum { RDM_DEFAULT_MIN_DMX_FRAMES = 1 };
+    void setRDMMinDmxFrames(uint8_t frames);
+#endif
+
+    // Let the UART drive the RE/DE line from its RTS output at the end of
+    // an RDM request, so the transceiver turns round the moment the last
+    // stop bit has gone rather than when our code gets to it. The rest of
+    // the time, DMX included, the pin is driven like an RE/DE pin, so the
+    // driver never lets go of the line mid-frame. rtsPin must be the UART's
+    // RTS pin wired to RE/DE: 6 or 19 for Serial1, 22 for Serial2 or 2 for
+    // Serial3 on Teensy 3.x. Returns false for any other pin or UART.
+    bool useHardwareDirection(uint8_t rtsPin);
+#if TEENSYDMX_RDM_CONTROLLER
+    const RdmResponderLatencyStats& getRDMResponderLatencyStats() const;
+    void clearRDMResponderLatencyStats();
+#endif
+
+    // Cycles spent at each ProfileSite, returns false unless built with
+    // TEENSYDMX_PROFILING
+    bool getProfileStats(ProfileSite site, ProfileStats& stats) const;
+    void clearProfileStats();
+
+#if TEENSYDMX_RDM_CONTROLLER
+    // E1.20 minimum controller packet spacing in microseconds, after any
+    // response or broadcast and after a DUB respectively
+    enum { RDM_CONTROLLER_PACKET_SPACING = 176 };
+    enum { RDM_DUB_PACKET_SPACING = 5800 };
 
-    enum { RDM_TIMEOUT_DURATION = 2000 };
-    enum { RDM_DUB_TIMEOUT_DURATION = 100 };
-
-    enum { DUB_ACTION_OFFSET = RDM_DUB_TIMEOUT_DURATION * 2 };
-    enum { DISCOVERY_ACTION_OFFSET = RDM_TIMEOUT_DURATION * 2 };
-
-    void sendRDMDiscMute(byte *uid);
-    void sendRDMDiscUnMute(byte *uid);
-    void sendRDMDiscUniqueBranch(byte *lower_uid, byte *upper_uid);
-    void sendRDMDiscUniqueBranch(uint64_t lower_uid, uint64_t upper_uid);
-    void sendRDMGetDeviceInfo(byte *uid);
-    void sendRDMGetIdentifyDevice(byte *uid);
-    void sendRDMSetIdentifyDevice(byte *uid, bool identify_state);
-    void sendRDMGetDmxStartAddress(byte *uid);
-    void sendRDMSetDmxStartAddress(byte *uid, uint16_t dmx_address);
-    void sendRDMGetDmxPersonality(byte *uid);
-    void sendRDMSetDmxPersonality(byte *uid, uint8_t personality);
-    void sendRDMGetDmxPersonalityDescription(byte *uid, uint8_t personality);
-    void sendRDMGetManufacturerLabel(byte *uid);
-    void sendRDMGetDeviceLabel(byte *uid);
-    void sendRDMGetDeviceModelDescription(byte *uid);
-    void sendRDMSetResetDevice(byte *uid, uint8_t reset_mode);
-    void sendRDMGetPanInvert(byte *uid);
-    void sendRDMSetPanInvert(byte *uid, bool invert);
-    void sendRDMGetTiltInvert(byte *uid);
-    void sendRDMSetTiltInvert(byte *uid, bool invert);
-    void sendRDMGetPanTiltSwap(byte *uid);
-    void sendRDMSetPanTiltSwap(byte *uid, bool swap);
-    void sendRDMGetFactoryDefaults(byte *uid);
-    void sendRDMSetFactoryDefaults(byte *uid);
-    void sendRDMGetLampState(byte *uid);
-    void sendRDMSetLampState(byte *uid, uint8_t lamp_state);
-    void sendRDMGetLampOnMode(byte *uid);
-    void sendRDMSetLampOnMode(byte *uid, uint8_t mode);
-    void sendRDMGetPowerOnSelfTest(byte *uid);
-    void sendRDMSetPowerOnSelfTest(byte *uid, bool power_on_self_test);
-    void sendRDMGetPerformSelftest(byte *uid);
-    void sendRDMSetPerformSelftest(byte *uid, uint8_t test_number);
-    void sendRDMGetSelfTestDescription(byte *uid, uint8_t test_number);
-    void sendRDMGetSensorDefinition(byte *uid, uint8_t sensor_number);
-    void sendRDMGetSensorValue(byte *uid, uint8_t sensor_number);
-    void sendRDMSetSensorValue(byte *uid, uint8_t sensor_number);
-    void sendRDMSetRecordSensors(byte *uid, uint8_t sensor_number);
+    // Statistics for the current, or last completed, discovery
+    const RdmDiscoveryStats& getRDMDiscoveryStats() const;
+
+    // Only for lines known to OR colliding DUB responses together: use the
+    // merged bits to skip empty parts of the UID space, rather than always
+    // splitting at the midpoint. Off by default, as on a line which ANDs or
+    // garbles collisions it costs DUBs rather than saving them. Any
+    // discovery which relied on it ends with a plain check.
+    void setRDMWiredOrDecoding(bool enabled);
+
+    bool sendRDMDiscMute(byte *uid);
+    bool sendRDMDiscUnMute(byte *uid);
+    // A single answer completes with CB_SUCCESS and a response from the UID
+    // which sent it, more than one with CB_RDM_CHECKSUM_ERROR
+    bool sendRDMDiscUniqueBranch(byte *lower_uid, byte *upper_uid);
+    bool sendRDMDiscUniqueBranch(uint64_t lower_uid, uint64_t upper_uid);
+    bool sendRDMGetDeviceInfo(byte *uid);
+    bool sendRDMGetIdentifyDevice(byte *uid);
+    bool sendRDMSetIdentifyDevice(byte *uid, bool identify_state);
+    bool sendRDMGetDmxStartAddress(byte *uid);
+    bool sendRDMSetDmxStartAddress(byte *uid, uint16_t dmx_address);
+    bool sendRDMGetDmxPersonality(byte *uid);
+    bool sendRDMSetDmxPersonality(byte *uid, uint8_t personality);
+    bool sendRDMGetDmxPersonalityDescription(byte *uid, uint8_t personality);
+    bool sendRDMGetManufacturerLabel(byte *uid);
+    bool sendRDMGetDeviceLabel(byte *uid);
+    bool sendRDMGetDeviceModelDescription(byte *uid);
+    bool sendRDMSetResetDevice(byte *uid, uint8_t reset_mode);
+    bool sendRDMGetPanInvert(byte *uid);
+    bool sendRDMSetPanInvert(byte *uid, bool invert);
+    bool sendRDMGetTiltInvert(byte *uid);
+    bool sendRDMSetTiltInvert(byte *uid, bool invert);
+    bool sendRDMGetPanTiltSwap(byte *uid);
+    bool sendRDMSetPanTiltSwap(byte *uid, bool swap);
+    bool sendRDMGetFactoryDefaults(byte *uid);
+    bool sendRDMSetFactoryDefaults(byte *uid);
+    bool sendRDMGetLampState(byte *uid);
+    bool sendRDMSetLampState(byte *uid, uint8_t lamp_state);
+    bool sendRDMGetLampOnMode(byte *uid);
+    bool sendRDMSetLampOnMode(byte *uid, uint8_t mode);
+    bool sendRDMGetPowerOnSelfTest(byte *uid);
+    bool sendRDMSetPowerOnSelfTest(byte *uid, bool power_on_self_test);
+    bool sendRDMGetPerformSelftest(byte *uid);
+    bool sendRDMSetPerformSelftest(byte *uid, uint8_t test_number);
+    bool sendRDMGetSelfTestDescription(byte *uid, uint8_t test_number);
+    bool sendRDMGetSensorDefinition(byte *uid, uint8_t sensor_number);
+    bool sendRDMGetSensorValue(byte *uid, uint8_t sensor_number);
+    bool sendRDMSetSensorValue(byte *uid, uint8_t sensor_number);
+    bool sendRDMSetRecordSensors(byte *uid, uint8_t sensor_number);
+#endif
+
+  protected:
+    // The interrupt handlers attached while receiving and transmitting.
+    // A TeensyDmxPort swaps in its own for the shared per UART ones.
+    struct UartIsrs
+    {
+        void (*rxStatus)();
+        void (*rxError)();
+        void (*txStatus)();
+    };
+    UartIsrs m_isrs;
+
+    void handleByte(uint8_t c);  // Called at status ISR during recv
+    void completeFrame();  // Called at error ISR during recv
+    void nextTx();  // Called at status ISR on TX complete
+    void maybeHandOverDirection(uint8_t s1);  // Called at status ISR after nextTx
+
+    // Times its own lifetime into a ProfileSite of dmx, compiles to nothing
+    // unless built with TEENSYDMX_PROFILING
+    class ProfileScope
+    {
+      public:
+#ifdef TEENSYDMX_PROFILING
+        ProfileScope(TeensyDmx *dmx, ProfileSite site) :
+            m_dmx(dmx),
+            m_site(site),
+            m_start(ARM_DWT_CYCCNT)
+        { }
+
+        ~ProfileScope() {
+            if (m_dmx != nullptr) {
+                m_dmx->recordProfile(m_site, ARM_DWT_CYCCNT - m_start);
+            }
+        }
+
+      private:
+        TeensyDmx *m_dmx;
+        ProfileSite m_site;
+        uint32_t m_start;
+#else
+        ProfileScope(TeensyDmx *dmx, ProfileSite site) {
+            (void)dmx;
+            (void)site;
+        }
+#endif
+    };
 
   private:
     TeensyDmx(const TeensyDmx&);
@@ -203,6 +747,9 @@ class TeensyDmx
                  BREAK,  // In break
                  // DMX transmit states:
                  DMX_TX,  // In DMX transmit
+                 // RDM controller transmit states:
+                 RDM_TX_BREAK,  // In RDM break
+                 RDM_TX,  // Sending an RDM request
                  // DMX receive states:
                  DMX_RECV,  // Receiving a DMX frame
                  DMX_COMPLETE,  // DMX frame complete
@@ -222,31 +769,125 @@ class TeensyDmx
                  RDM_DUB_POST_CHECKSUM  // Excess bytes after RDM checksum
                };
 
-    enum DiscoveryState { DISCOVERY_IDLE, DISCOVERY_MUTE, DISCOVERY_UN_MUTE, DISCOVERY_DUB };
+    enum DiscoveryState { DISCOVERY_IDLE, DISCOVERY_MUTE, DISCOVERY_UN_MUTE, DISCOVERY_VERIFY, DISCOVERY_DUB };
 
     enum ControllerState { CONTROLLER_IDLE, RDM_DUB, RDM_DUB_COLLISION, RDM_DUB_TIMEOUT, RDM_BROADCAST, RDM_TIMEOUT, RDM_CHECKSUM_ERROR, RDM_MESSAGE };
 
+    void attachTxInterrupt();
     void startTransmit();
     void stopTransmit();
     void startReceive();
     void stopReceive();
 
     void setDirection(bool transmit);
+#ifdef TEENSYDMX_PROFILING
+    void recordProfile(ProfileSite site, uint32_t cycles);
+#endif
 
+#if TEENSYDMX_RDM_CONTROLLER
+    void noteRDMResponseStart();
     void maybeTimeoutRDMMessage();
     void maybeProgressRDMDiscovery();
+    bool canSendRDMRequest() const;
 
-    void completeFrame();  // Called at error ISR during recv
     void processControllerRDM();
-    void processResponderRDM();
     void processDiscovery();
+    void pushDubRange(uint64_t lower, uint64_t upper);
+    void completeRDMDiscovery();
+    void startRDMDiscovery();
+    void maybeStartIncrementalDiscovery();
+    void processVerifyResponse(CallbackStatus status);
+    void processMuteResponse(CallbackStatus status);
+    void splitDubRange();
+    void sendUidEvent(RdmUidEvent event, const byte *uid);
+    bool decodeDubCollision();
+    void decodeDubResponse();
+
+    struct RdmRequest
+    {
+        byte destId[RDM_UID_LENGTH];
+        uint16_t subDev;
+        uint16_t pid;
+        uint8_t cmdClass;
+        uint8_t dataLength;
+        byte data[RDM_MAX_REQUEST_DATA_LENGTH];
+        RdmRequestCallback callback;
+        void *context;
+        uint32_t tag;
+        uint8_t attempts;  // Retries sent so far
+    };
+
+    // Largest response, and request parameter data, we'll cache
+    enum { RDM_MAX_CACHED_DATA_LENGTH = RDM_MAX_STRING_LENGTH };
+    enum { RDM_MAX_CACHED_PARAM_LENGTH = 4 };
+
+    struct RdmCacheEntry
+    {
+        byte uid[RDM_UID_LENGTH];
+        uint16_t subDev;
+        uint16_t pid;
+        uint8_t paramLength;
+        byte param[RDM_MAX_CACHED_PARAM_LENGTH];
+        uint8_t dataLength;
+        byte data[RDM_MAX_CACHED_DATA_LENGTH];
+        uint32_t expires;  // millis()
+        bool used;
+    };
+
+    struct RdmCacheTtl
+    {
+        uint16_t pid;
+        uint32_t ttl;
+    };
+
+    uint32_t getRDMCacheTTL(uint16_t pid) const;
+    bool isRDMCacheable(const RdmRequest& request) const;
+
+    struct RdmDeferredRequest
+    {
+        RdmRequest request;  // The original request, unused when draining
+        uint32_t due;  // millis() at which to send GET QUEUED_MESSAGE
+        uint8_t attempts;
+        bool drain;  // Just fetching queued messages, no original request
+        bool used;
+    };
+
+    bool deferRDMRequest(const RdmRequest& request, uint32_t delay);
+    void scheduleRDMQueuedMessageDrain(const byte *uid);
+    bool maybeSendDeferredRDMRequest();
+    void processDeferredResponse(CallbackStatus status, RdmData *data);
+    void retryDeferredRDMRequest(RdmDeferredRequest& deferred, CallbackStatus status,
+                                 uint32_t delay);
+    void finishDeferredRDMRequest(RdmDeferredRequest& deferred, CallbackStatus status,
+                                  RdmData *data);
+
+    bool isRDMRetryable(const RdmRequest& request);
+    bool maybeRetryRDMRequest(RdmRequest& request, CallbackStatus status);
+    RdmDeviceStats* getRDMDeviceStatsEntry(const byte *uid);
+    void recordRDMDeviceStats(CallbackStatus status);
+    RdmCacheEntry* findRDMCacheEntry(const RdmRequest& request);
+    bool maybeAnswerFromCache();
+    void storeRDMCacheEntry(const RdmRequest& request, const RdmData& response);
+    void invalidateRDMCache(const RdmRequest& request);
+
+    void fillRDMRequest(RdmRequest& request, const byte *uid,
+                        uint8_t commandClass, uint16_t pid,
+                        const byte *data, uint8_t dataLength);
+    void maybeSendQueuedRDMRequest();
+    void completeRDMRequest(CallbackStatus status, RdmData *data);
+    bool isExpectedResponse() const;
+    void sendDiscoveryRequest(const byte *uid, uint16_t pid,
+                              const byte *data, uint8_t dataLength);
+    void sendRDMRequest(const RdmRequest& request);
+    void startRDMTransmit();
+    void maybeResumeDmx();
+    void finishRDMTransmit();
+#endif
+
+#if TEENSYDMX_RDM_RESPONDER
+    void processResponderRDM();
     void respondMessage(uint16_t nackReason);
-    void sendRDMDiscUniqueBranch();
-    void buildSendRDMMessage(byte *uid, uint8_t commandClass, uint16_t pid);
     void sendRDMMessage();
-    void handleByte(uint8_t c);
-
-    void nextTx();
 
     // RDM handler functions
     void rdmDiscUniqueBranch();
@@ -265,7 +906,9 @@ class TeensyDmx
     uint16_t rdmGetManufacturerLabel();
     uint16_t rdmGetSoftwareVersionLabel();
     uint16_t rdmGetSupportedParameters();
+#endif
 
+#if TEENSYDMX_RDM
     uint16_t rdmCalculateChecksum(uint8_t* data, uint8_t length);
     bool isForMe(const byte* id);
     bool isForVendor(const byte* id);
@@ -275,45 +918,148 @@ class TeensyDmx
     void maybeIncrementShortMessage();
     void maybeIncrementChecksumFail();
     void maybeIncrementLengthMismatch();
+#endif
 
     HardwareSerial& m_uart;
 
-    volatile uint8_t m_dmxBuffer1[DMX_BUFFER_SIZE];
-    volatile uint8_t m_dmxBuffer2[DMX_BUFFER_SIZE];
-    volatile uint8_t *m_activeBuffer;
-    volatile uint8_t *m_inactiveBuffer;
-    volatile uint16_t m_dmxBufferIndex;
-    volatile unsigned int m_frameCount;
+#if TEENSYDMX_RDM
     volatile uint16_t m_shortMessage;
     volatile uint16_t m_checksumFail;
     volatile uint16_t m_lengthMismatch;
-    volatile bool m_newFrame;
+    RdmInit *m_rdm;
+    volatile bool m_rdmNeedsProcessing;
+    RdmData m_rdmBuffer;
+    uint16_t m_rdmChecksum;
+    // Checksum of the received packet, accumulated as each byte arrives
+    uint16_t m_rdmRunningChecksum;
+#endif
+#if TEENSYDMX_RDM_RESPONDER
     volatile bool m_rdmChange;
-    unsigned long m_rdmResponseDue;
-    Mode m_mode;
-    State m_state;
+    // Set if the receive window follows our start address and footprint
+    bool m_rxWindowFollowsRdm;
+    bool m_rdmMute;
+    bool m_identifyMode;
+    // Allow an extra byte for a null if we have a 32 character string
+    char m_deviceLabel[RDM_MAX_STRING_LENGTH + 1];
+    static_assert((sizeof(m_deviceLabel) == 33), "Invalid size for m_deviceLabel");
+#endif
+#if TEENSYDMX_RDM_CONTROLLER
+    // micros() at which the outstanding response is overdue
+    volatile uint32_t m_rdmResponseDue;
+    uint32_t m_rdmTimeoutMargin;
+    bool m_rdmResponseStarted;
+    // Set while the TX interrupt is sending a controller request
+    volatile bool m_rdmTransmitting;
+    // Set while a request waits for the DMX frame in progress to finish
+    volatile bool m_rdmTransmitPending;
+    // Set from when a request takes the line until DMX restarts
+    volatile bool m_dmxPaused;
+    // DMX frames completed since DMX last restarted
+    volatile uint8_t m_dmxFramesSent;
+    uint8_t m_rdmMinDmxFrames;
+    uint16_t m_rdmTxChecksum;
     DiscoveryState m_discoveryState;
-    unsigned long m_nextDiscoveryAction;
-    enum { MAX_DUB_QUEUE = 30 };
+    // micros() of the start of the current discovery
+    uint32_t m_discoveryStart;
+    RdmDiscoveryStats m_discoveryStats;
+    // micros() at the end of our last request, and when we may send the next
+    volatile uint32_t m_rdmRequestEnd;
+    uint32_t m_rdmNextRequestAllowed;
+    // Each collision pops one range and pushes its two halves, so the stack
+    // can't get deeper than one range per UID bit plus the initial one
+    enum { MAX_DUB_QUEUE = 49 };
+    static_assert((MAX_DUB_QUEUE == (RDM_UID_LENGTH * 8) + 1),
+                  "The DUB stack must be exactly as deep as a search over every UID bit");
     uint64_t m_dubQueue[MAX_DUB_QUEUE * 2];
     uint8_t m_dubPointer;
 
     uint64_t m_dubLowerBoundUid;
     uint64_t m_dubUpperBoundUid;
-    enum { MAX_UID_LIST = 40 };
-    uint8_t m_uidList[MAX_UID_LIST * RDM_UID_LENGTH];
-    uint8_t m_uidCount;
+    RdmUidSet m_uids;
+    // The UID found by the last DUB, which we need to mute next
+    byte m_lastFoundUid[RDM_UID_LENGTH];
+    bool m_uidOverflow;
+    // Set when discovery adds or removes a UID, so we know to save it
+    bool m_uidTableChanged;
+    uint16_t m_uidVersion;
+    int m_uidStorageAddress;
+    bool m_wiredOrDecoding;
+    // True while this discovery may still decode collisions, it's turned
+    // off for the final check
+    bool m_dubDecodingActive;
+    // Set if a decoded collision let us skip part of the UID space
+    bool m_dubPruned;
+    // Waiting on the mute of the UID a DUB just found, which only goes in
+    // the table once the device answers
+    bool m_mutePending;
+    // Next known UID to check is still present, and whether we're waiting
+    // on its mute response
+    uint16_t m_verifyIndex;
+    bool m_verifyPending;
+    uint8_t m_verifyAttempts;
+    enum { MAX_VERIFY_ATTEMPTS = 2 };
+    uint32_t m_discoveryInterval;
+    // millis() at which the last discovery finished
+    uint32_t m_lastDiscoveryEnd;
+    // Set by the ISR when a full DUB response arrived with a bad checksum
+    volatile bool m_dubResponseComplete;
     ControllerState m_controllerState;
+    RdmRequest m_requestQueue[MAX_RDM_REQUEST_QUEUE];
+    uint8_t m_requestHead;
+    uint8_t m_requestCount;
+    bool m_requestInFlight;
+    // Whether a queued request gets the next gap on the bus ahead of
+    // discovery, so they take turns
+    bool m_queueTurn;
+    uint8_t m_transactionNumber;
+    uint8_t m_lastTransactionNumber;
+    RdmDeferredRequest m_deferredRequests[MAX_RDM_DEFERRED_REQUESTS];
+    // Index of the deferred request whose follow up is on the wire, or -1
+    int8_t m_deferredInFlight;
+    RdmCacheEntry m_rdmCache[TEENSYDMX_RDM_CACHE_SIZE];
+    RdmCacheTtl m_rdmCacheTtls[MAX_RDM_CACHE_TTL_OVERRIDES];
+    uint8_t m_rdmCacheTtlCount;
+    uint32_t m_rdmCacheHits;
+    uint32_t m_rdmCacheMisses;
+    uint8_t m_rdmMaxRetries;
+    uint32_t m_rdmRetryBackoff;
+    // millis() before which the retry at the head of the queue waits
+    uint32_t m_rdmRetryDue;
+    RdmDeviceStats m_deviceStats[TEENSYDMX_MAX_RDM_DEVICE_STATS];
+    uint8_t m_deviceStatsCount;
+    // The device the outstanding request went to, if it expects a response
+    byte m_statsUid[RDM_UID_LENGTH];
+    bool m_statsPending;
+    // micros() at the end of the last response
+    volatile uint32_t m_rdmResponseEnd;
+    // Set until the response to our last request starts
+    volatile bool m_latencyPending;
+    RdmResponderLatencyStats m_latencyStats;
+#endif
+
+    volatile uint8_t m_dmxBuffer1[DMX_BUFFER_SIZE];
+    volatile uint8_t m_dmxBuffer2[DMX_BUFFER_SIZE];
+    volatile uint8_t *m_activeBuffer;
+    volatile uint8_t *m_inactiveBuffer;
+    volatile uint16_t m_dmxBufferIndex;
+    volatile unsigned int m_frameCount;
+    volatile bool m_newFrame;
+    Mode m_mode;
+    State m_state;
     volatile uint8_t* m_redePin;
-    bool m_rdmMute;
-    bool m_identifyMode;
-    RdmInit *m_rdm;
-    volatile bool m_rdmNeedsProcessing;
-    RdmData m_rdmBuffer;
-    uint16_t m_rdmChecksum;
-    // Allow an extra byte for a null if we have a 32 character string
-    char m_deviceLabel[RDM_MAX_STRING_LENGTH + 1];
-    static_assert((sizeof(m_deviceLabel) == 33), "Invalid size for m_deviceLabel");
+    // The UART's MODEM register and the RTS pin's config when it drives
+    // RE/DE itself, m_redePin is then that pin's output
+    volatile uint8_t* m_uartModem;
+    volatile uint32_t* m_rtsConfig;
+    // The last byte of a request has been written, RTS takes the pin next
+    volatile bool m_rtsHandoverPending;
+    // Slots of each received frame that are stored, the first one at the
+    // start of the buffer
+    volatile uint16_t m_rxWindowStart;
+    volatile uint16_t m_rxWindowEnd;
+#ifdef TEENSYDMX_PROFILING
+    ProfileStats m_profile[PROFILE_SITE_COUNT];
+#endif
 
     friend void UART0RxStatus(void);
     friend void UART0TxStatus(void);
@@ -343,4 +1089,460 @@ class TeensyDmx
 #endif
 };
 
+#if TEENSYDMX_RDM_CONTROLLER
+// Everything RdmInventory fetches for a device, strings are null terminated
+struct RdmDeviceRecord
+{
+    byte uid[RDM_UID_LENGTH];
+    uint16_t deviceModelId;
+    uint16_t productCategory;
+    uint32_t softwareVersionId;
+    uint16_t footprint;
+    uint8_t currentPersonality;
+    uint8_t personalityCount;
+    uint16_t startAddress;
+    uint16_t subDeviceCount;
+    uint8_t sensorCount;
+    char manufacturerLabel[RDM_MAX_STRING_LENGTH + 1];
+    char deviceModel[RDM_MAX_STRING_LENGTH + 1];
+    char deviceLabel[RDM_MAX_STRING_LENGTH + 1];
+};
+
+enum RdmInventoryEvent {
+    INVENTORY_DEVICE_READY,  // Everything has been fetched for a new device
+    INVENTORY_DEVICE_CHANGED,  // A refresh found something different
+    INVENTORY_DEVICE_REMOVED,  // Discovery lost the device
+    INVENTORY_COMPLETE  // Every known device is ready, device is nullptr
+};
+
+using RdmInventoryCallback = void(*)(RdmInventoryEvent, const RdmDeviceRecord *device);
+
+// Fetches DEVICE_INFO and the labels for every UID the controller discovers,
+// keeping the request queue full so the GETs are sent back to back.
+// Call loop() after the TeensyDmx loop().
+class RdmInventory
+{
+  public:
+    enum { CAPACITY = TEENSYDMX_MAX_RDM_DEVICES };
+
+    RdmInventory(TeensyDmx& dmx, RdmInventoryCallback callback);
+
+    void loop();
+    // Fetch everything again, reporting any devices which have changed.
+    // Responses still in the controller's GET cache are reused.
+    void refresh();
+
+    uint16_t getDeviceCount() const;
+    // Devices live in fixed slots from 0 to CAPACITY - 1, unused slots
+    // return nullptr
+    const RdmDeviceRecord* getDevice(uint16_t slot) const;
+    const RdmDeviceRecord* findDevice(const byte *uid) const;
+    // True when every known device has been fetched
+    bool isComplete() const;
+
+  private:
+    RdmInventory(const RdmInventory&);
+    RdmInventory& operator=(const RdmInventory&);
+
+    enum Field { FIELD_DEVICE_INFO, FIELD_MANUFACTURER_LABEL, FIELD_DEVICE_MODEL,
+                 FIELD_DEVICE_LABEL, FIELD_COUNT };
+    enum { FIELDS_ALL = (1 << FIELD_COUNT) - 1 };
+
+    struct Slot
+    {
+        RdmDeviceRecord record;
+        bool used;
+        bool ready;  // Reported as ready
+        bool changed;  // Something differed during this fetch
+        uint8_t generation;  // Changes when the slot is reused
+        uint8_t wanted;  // Fields still to request
+        uint8_t pending;  // Fields requested but not answered
+    };
+
+    static void handleResponse(CallbackStatus status, const RdmResponse& response,
+                               void *context, uint32_t tag);
+    void processResponse(Slot& slot, Field field, CallbackStatus status,
+                         const RdmResponse& response);
+    void syncWithUids();
+    void queueFetches();
+    void maybeReport(Slot& slot);
+    Slot* findSlot(const byte *uid);
+
+    TeensyDmx& m_dmx;
+    RdmInventoryCallback m_callback;
+    Slot m_slots[CAPACITY];
+    uint16_t m_deviceCount;
+    uint16_t m_uidVersion;
+    // Fields wanted across all slots, so loop() can skip the scan
+    uint16_t m_fieldsWanted;
+    uint16_t m_fieldsPending;
+    uint16_t m_nextSlot;
+    bool m_completeReported;
+};
+
+// Called when a polled value is first fetched and whenever it changes,
+// including the device starting or stopping answering. uid and pid are those
+// subscribed to, the response is only valid during the callback.
+using RdmPollCallback = void(*)(int16_t subscription, const byte *uid, uint16_t pid,
+                                CallbackStatus status, const RdmResponse& response);
+
+// Polls GETs like SENSOR_VALUE or LAMP_STATE for a set of subscriptions, one
+// request at a time and no closer together than the poll spacing, so the
+// load on the RDM line is predictable whatever the subscriptions ask for.
+// Call loop() after the TeensyDmx loop().
+class RdmPoller
+{
+  public:
+    enum { CAPACITY = TEENSYDMX_MAX_RDM_POLLS };
+    enum { MAX_PARAM_LENGTH = 4 };
+    // Longest response kept to spot changes, enough for sensors, lamp state
+    // and labels; longer responses are reported every time
+    enum { MAX_VALUE_LENGTH = RDM_MAX_STRING_LENGTH };
+    // Milliseconds between polls, roughly one full DMX frame
+    enum { DEFAULT_POLL_SPACING = 25 };
+
+    RdmPoller(TeensyDmx& dmx, RdmPollCallback callback);
+
+    // Poll pid on uid every interval milliseconds, returning a subscription
+    // number or -1 if there's no room. Subscribing to the same GET again
+    // shares the existing subscription, polling at the shorter interval.
+    int16_t subscribe(const byte *uid, uint16_t pid, uint32_t interval,
+                      const byte *param = nullptr, uint8_t paramLength = 0);
+    int16_t subscribeSensorValue(const byte *uid, uint8_t sensor, uint32_t interval);
+    int16_t subscribeLampState(const byte *uid, uint32_t interval);
+    // Drops one reference to the subscription, the polling stops with the last
+    bool unsubscribe(int16_t subscription);
+    uint16_t getSubscriptionCount() const;
+
+    void setPollSpacing(uint32_t spacing);
+    // Report every subscription again on its next response
+    void resetChanges();
+    void loop();
+
+  private:
+    RdmPoller(const RdmPoller&);
+    RdmPoller& operator=(const RdmPoller&);
+
+    struct Subscription
+    {
+        byte uid[RDM_UID_LENGTH];
+        uint16_t pid;
+        byte param[MAX_PARAM_LENGTH];
+        uint8_t paramLength;
+        uint8_t references;
+        uint8_t generation;  // Changes when the subscription is reused
+        bool reported;  // The last value has been passed to the callback
+        uint32_t interval;
+        uint32_t due;  // millis() of the next poll
+        // The last reported status and response
+        CallbackStatus lastStatus;
+        uint8_t lastType;
+        uint8_t lastLength;
+        byte lastValue[MAX_VALUE_LENGTH];
+    };
+
+    static void handleResponse(CallbackStatus status, const RdmResponse& response,
+                               void *context, uint32_t tag);
+    void processResponse(int16_t index, CallbackStatus status, const RdmResponse& response);
+    int16_t findDuePoll(uint32_t now) const;
+
+    TeensyDmx& m_dmx;
+    RdmPollCallback m_callback;
+    Subscription m_subscriptions[CAPACITY];
+    uint16_t m_subscriptionCount;
+    uint32_t m_pollSpacing;
+    uint32_t m_lastPoll;
+    bool m_pollInFlight;
+};
+#endif
+
+// Back references to the Teensyduino serial core
+void uart0_status_isr();
+void uart0_error_isr();
+void uart1_status_isr();
+void uart1_error_isr();
+void uart2_status_isr();
+void uart2_error_isr();
+#ifdef HAS_KINETISK_UART3
+void uart3_status_isr();
+void uart3_error_isr();
+#endif
+#ifdef HAS_KINETISK_UART4
+void uart4_status_isr();
+void uart4_error_isr();
+#endif
+#ifdef HAS_KINETISK_UART5
+void uart5_status_isr();
+void uart5_error_isr();
+#endif
+
+// Compile time description of UART N, for TeensyDmxPort
+template <uint8_t N> struct TeensyDmxUart;
+
+template <> struct TeensyDmxUart<0>
+{
+#ifdef HAS_KINETISK_UART0_FIFO
+    enum { HAS_FIFO = 1 };
+    static volatile uint8_t& rcfifo() { return UART0_RCFIFO; }
+    static volatile uint8_t& cfifo() { return UART0_CFIFO; }
+#else
+    enum { HAS_FIFO = 0 };
+#endif
+    static HardwareSerial& serial() { return Serial1; }
+    static volatile uint8_t& s1() { return UART0_S1; }
+    static volatile uint8_t& d() { return UART0_D; }
+    static void statusIsr() { uart0_status_isr(); }
+    // Without a FIFO, flush after a break as UART0RxStatus() does
+    static void flushOnBreak() { UART0_CFIFO = UART_CFIFO_RXFLUSH; }
+};
+
+template <> struct TeensyDmxUart<1>
+{
+#ifdef HAS_KINETISK_UART1_FIFO
+    enum { HAS_FIFO = 1 };
+    static volatile uint8_t& rcfifo() { return UART1_RCFIFO; }
+    static volatile uint8_t& cfifo() { return UART1_CFIFO; }
+#else
+    enum { HAS_FIFO = 0 };
+#endif
+    static HardwareSerial& serial() { return Serial2; }
+    static volatile uint8_t& s1() { return UART1_S1; }
+    static volatile uint8_t& d() { return UART1_D; }
+    static void statusIsr() { uart1_status_isr(); }
+    static void flushOnBreak() { }
+};
+
+template <> struct TeensyDmxUart<2>
+{
+#ifdef HAS_KINETISK_UART2_FIFO
+    enum { HAS_FIFO = 1 };
+    static volatile uint8_t& rcfifo() { return UART2_RCFIFO; }
+    static volatile uint8_t& cfifo() { return UART2_CFIFO; }
+#else
+    enum { HAS_FIFO = 0 };
+#endif
+    static HardwareSerial& serial() { return Serial3; }
+    static volatile uint8_t& s1() { return UART2_S1; }
+    static volatile uint8_t& d() { return UART2_D; }
+    static void statusIsr() { uart2_status_isr(); }
+    static void flushOnBreak() { }
+};
+
+#ifdef HAS_KINETISK_UART3
+template <> struct TeensyDmxUart<3>
+{
+#ifdef HAS_KINETISK_UART3_FIFO
+    enum { HAS_FIFO = 1 };
+    static volatile uint8_t& rcfifo() { return UART3_RCFIFO; }
+    static volatile uint8_t& cfifo() { return UART3_CFIFO; }
+#else
+    enum { HAS_FIFO = 0 };
+#endif
+    static HardwareSerial& serial() { return Serial4; }
+    static volatile uint8_t& s1() { return UART3_S1; }
+    static volatile uint8_t& d() { return UART3_D; }
+    static void statusIsr() { uart3_status_isr(); }
+    static void flushOnBreak() { }
+};
+#endif
+
+#ifdef HAS_KINETISK_UART4
+template <> struct TeensyDmxUart<4>
+{
+#ifdef HAS_KINETISK_UART4_FIFO
+    enum { HAS_FIFO = 1 };
+    static volatile uint8_t& rcfifo() { return UART4_RCFIFO; }
+    static volatile uint8_t& cfifo() { return UART4_CFIFO; }
+#else
+    enum { HAS_FIFO = 0 };
+#endif
+    static HardwareSerial& serial() { return Serial5; }
+    static volatile uint8_t& s1() { return UART4_S1; }
+    static volatile uint8_t& d() { return UART4_D; }
+    static void statusIsr() { uart4_status_isr(); }
+    static void flushOnBreak() { }
+};
+#endif
+
+#ifdef HAS_KINETISK_UART5
+template <> struct TeensyDmxUart<5>
+{
+#ifdef HAS_KINETISK_UART5_FIFO
+    enum { HAS_FIFO = 1 };
+    static volatile uint8_t& rcfifo() { return UART5_RCFIFO; }
+    static volatile uint8_t& cfifo() { return UART5_CFIFO; }
+#else
+    enum { HAS_FIFO = 0 };
+#endif
+    static HardwareSerial& serial() { return Serial6; }
+    static volatile uint8_t& s1() { return UART5_S1; }
+    static volatile uint8_t& d() { return UART5_D; }
+    static void statusIsr() { uart5_status_isr(); }
+    static void flushOnBreak() { }
+};
+#endif
+
+// A TeensyDmx fixed to UART N (0 for Serial1 up to 5 for Serial6) at compile
+// time. Its interrupt handlers are generated for that UART alone, so they
+// reach the registers and the instance directly rather than through
+// uartInstances, and the receive loop is inlined into the handler. The
+// state machine behind it, handleByte(), completeFrame() and nextTx(), is
+// still called out of line, and the difference hasn't been measured on a
+// Teensy; build with TEENSYDMX_PROFILING and compare the RX status profile
+// of both before choosing one for speed.
+// Otherwise it's used exactly like TeensyDmx, for example
+//   TeensyDmxPort<0> Dmx(&rdmData, DMX_REDE);
+template <uint8_t N>
+class TeensyDmxPort : public TeensyDmx
+{
+  public:
+    typedef TeensyDmxUart<N> Uart;
+
+    TeensyDmxPort(struct RdmInit* rdm, uint8_t redePin) :
+        TeensyDmx(Uart::serial(), rdm, redePin)
+    {
+        bind();
+    }
+
+    explicit TeensyDmxPort(struct RdmInit* rdm) :
+        TeensyDmx(Uart::serial(), rdm)
+    {
+        bind();
+    }
+
+    explicit TeensyDmxPort(uint8_t redePin) :
+        TeensyDmx(Uart::serial(), nullptr, redePin)
+    {
+        bind();
+    }
+
+    TeensyDmxPort() :
+        TeensyDmx(Uart::serial(), nullptr)
+    {
+        bind();
+    }
+
+  private:
+    TeensyDmxPort(const TeensyDmxPort&);
+    TeensyDmxPort& operator=(const TeensyDmxPort&);
+
+    template <bool HasFifo, typename Dummy = void>
+    struct Receiver;
+
+    template <typename Dummy>
+    struct Receiver<true, Dummy>
+    {
+        static void receive(TeensyDmxPort& port, uint8_t s)
+        {
+            if (s & (UART_S1_RDRF | UART_S1_IDLE)) {
+                __disable_irq();
+                uint8_t avail = Uart::rcfifo();
+                if (avail == 0) {
+                    (void) static_cast<uint8_t>(Uart::d());  // Read to discard
+                    Uart::cfifo() = UART_CFIFO_RXFLUSH;
+                    __enable_irq();
+                } else {
+                    __enable_irq();
+                    do {
+                        port.handleByte(Uart::d());
+                    } while (--avail);
+                }
+            }
+        }
+    };
+
+    template <typename Dummy>
+    struct Receiver<false, Dummy>
+    {
+        static void receive(TeensyDmxPort& port, uint8_t s)
+        {
+            if (s & UART_S1_FE) {
+                (void) static_cast<uint8_t>(Uart::d());  // Read to discard
+                Uart::flushOnBreak();
+                port.completeFrame();
+            } else if (s & UART_S1_RDRF) {
+                port.handleByte(Uart::d());
+            }
+        }
+    };
+
+    void bind()
+    {
+        s_port = this;
+        m_isrs.rxStatus = &rxStatus;
+        m_isrs.rxError = &rxError;
+        m_isrs.txStatus = &txStatus;
+    }
+
+    static void rxStatus()
+    {
+        ProfileScope profile(s_port, PROFILE_RX_STATUS);
+        Receiver<Uart::HAS_FIFO != 0>::receive(*s_port, Uart::s1());
+        Uart::statusIsr();
+        // Reset all flags on Teensy-LC
+#ifdef KINETISL
+        Uart::s1() = UART_S1_IDLE | UART_S1_OR | UART_S1_NF | UART_S1_FE | UART_S1_PF;
+#endif
+    }
+
+    // The frame error on a break is our cue to switch buffers
+    static void rxError()
+    {
+        ProfileScope profile(s_port, PROFILE_RX_ERROR);
+        if (Uart::s1() & UART_S1_FE) {
+            (void) static_cast<uint8_t>(Uart::d());  // Read to discard
+        }
+        s_port->completeFrame();
+    }
+
+    static void txStatus()
+    {
+        ProfileScope profile(s_port, PROFILE_TX_STATUS);
+        if (Uart::s1() & UART_S1_TC) {
+            s_port->nextTx();
+        }
+        Uart::statusIsr();
+        s_port->maybeHandOverDirection(Uart::s1());
+    }
+
+    static TeensyDmxPort *s_port;
+};
+
+template <uint8_t N>
+TeensyDmxPort<N> *TeensyDmxPort<N>::s_port = nullptr;
+
+#if TEENSYDMX_RDM_CONTROLLER
+// Drives several controller ports from one loop(), so discovery and queued
+// requests run on every line at once rather than one line after another
+class TeensyDmxManager
+{
+  public:
+    enum { MAX_PORTS = 6 };
+
+    TeensyDmxManager();
+
+    // Returns false if there's no room for another port
+    bool addPort(TeensyDmx& port);
+    uint8_t getPortCount() const;
+    TeensyDmx* getPort(uint8_t index);
+
+    void setMode(TeensyDmx::Mode mode);
+    void doRDMDiscovery();
+    void doRDMIncrementalDiscovery();
+    void doRDMWarmStartDiscovery();
+    // True once every port has finished discovery and emptied its queue
+    bool isRDMIdle() const;
+    void loop();
+
+  private:
+    TeensyDmxManager(const TeensyDmxManager&);
+    TeensyDmxManager& operator=(const TeensyDmxManager&);
+
+    TeensyDmx* m_ports[MAX_PORTS];
+    uint8_t m_portCount;
+    // Port serviced first on the next loop(), so none is always last
+    uint8_t m_nextPort;
+};
+#endif
+
 #endif  // _TEENSYDMX_H
@@ -13,20 +13,27 @@
 // The ID below is designated as a prototyping ID.
 byte myUid[] = {0x7f, 0xf0, 0x20, 0x12, 0x00, 0x00};
 
-#define MAX_UID_COUNT 40
-
-byte foundUids[RDM_UID_LENGTH * MAX_UID_COUNT];
-uint32_t uidNum = 0;
-
-// Broadcast to all devices, broadcasts don't generate a response
-byte theirUid[] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
-
-enum Status { DISCOVERY, DISCOVERY_IDLE, SWITCH_UID, IDENTIFY_ON, IDENTIFY_ON_IDLE, IDENTIFY_OFF, IDENTIFY_OFF_IDLE };
-Status currentState = DISCOVERY;
-unsigned long lastAction = 0;
+// Defined further down, once its RdmInit is ready
+extern TeensyDmx Dmx;
 
 void discoveryComplete(CallbackStatus callbackStatus, byte *uids, uint32_t uidCount) {
+  if (callbackStatus == CallbackStatus::CB_RDM_UID_OVERFLOW) {
+    Serial.println("Too many UIDs, increase TEENSYDMX_MAX_RDM_UIDS");
+    // We still get as many as would fit
+    callbackStatus = CallbackStatus::CB_SUCCESS;
+  } else if (callbackStatus == CallbackStatus::CB_RDM_CACHED) {
+    Serial.println("UIDs from last time, checking they're still there");
+    callbackStatus = CallbackStatus::CB_SUCCESS;
+  }
   if (callbackStatus == CallbackStatus::CB_SUCCESS) {
+    const RdmDiscoveryStats& stats = Dmx.getRDMDiscoveryStats();
+    Serial.print("Discovery took ");
+    Serial.print(stats.elapsedMicros / 1000);
+    Serial.print("ms, ");
+    Serial.print(stats.dubCount);
+    Serial.print(" DUBs, ");
+    Serial.print(stats.collisionCount);
+    Serial.println(" collisions");
     if (uidCount > 0) {
       Serial.println("Printing UIDs:");
 
@@ -46,9 +53,6 @@ void discoveryComplete(CallbackStatus callbackStatus, byte *uids, uint32_t uidCo
         Serial.println("");
       }
       Serial.println("");
-      memcpy(foundUids, uids, (uidCount * RDM_UID_LENGTH));
-      uidNum = uidCount;
-      currentState = SWITCH_UID;
     } else {
       Serial.println("No UIDs returned");
     }
@@ -59,20 +63,33 @@ void discoveryComplete(CallbackStatus callbackStatus, byte *uids, uint32_t uidCo
 
 void printRdm(CallbackStatus callbackStatus, RdmData *data) {
   if (callbackStatus == CallbackStatus::CB_SUCCESS) {
-    Serial.println("Decoding RDM:");
-    // TODO(Peter): Handle NAcks
-
-    Serial.print("Length: ");
-    Serial.println(data->length);
-    Serial.print("Data Length: ");
-    Serial.println(data->dataLength);
-    
-    Serial.print("Data: ");
-    for(int i = 0; i < data->dataLength; i++)
+    RdmResponse response(data);
+    Serial.print("PID 0x");
+    Serial.print(response.getPid(), HEX);
+    switch (response.getType())
     {
-       Serial.print(char(data->data[i]));
+      case RdmResponse::RESPONSE_ACK:
+        Serial.print(" ACK, data: ");
+        for(int i = 0; i < response.getDataLength(); i++)
+        {
+           Serial.print(response.getData()[i], HEX);
+           Serial.print(" ");
+        }
+        Serial.println("");
+        break;
+      case RdmResponse::RESPONSE_NACK:
+        Serial.print(" NACK, reason: 0x");
+        Serial.println(response.getNackReason(), HEX);
+        break;
+      case RdmResponse::RESPONSE_ACK_TIMER:
+        Serial.print(" ACK_TIMER, ask again in ");
+        Serial.print(response.getAckTimerDelay());
+        Serial.println("ms");
+        break;
+      default:
+        Serial.println(" unknown response type");
+        break;
     }
-    Serial.println("");
   } else if (callbackStatus == CallbackStatus::CB_RDM_BROADCAST) {
     Serial.println("RDM message was broadcast, no response expected");
   } else if (callbackStatus == CallbackStatus::CB_RDM_TIMEOUT) {
@@ -82,6 +99,64 @@ void printRdm(CallbackStatus callbackStatus, RdmData *data) {
   }
 }
 
+void printUid(const byte *uid) {
+  for(int i = 0; i < RDM_UID_LENGTH; i++)
+  {
+    Serial.print(uid[i], HEX);
+    if ((i + 1) < RDM_UID_LENGTH) {
+      // Don't print a colon after the last byte
+      Serial.print(":");
+    }
+  }
+}
+
+// The inventory fetches DEVICE_INFO and labels for each UID as discovery
+// finds it
+void inventoryEvent(RdmInventoryEvent event, const RdmDeviceRecord *device) {
+  switch (event)
+  {
+    case RdmInventoryEvent::INVENTORY_DEVICE_READY:
+    case RdmInventoryEvent::INVENTORY_DEVICE_CHANGED:
+      printUid(device->uid);
+      Serial.print(": ");
+      Serial.print(device->manufacturerLabel);
+      Serial.print(" ");
+      Serial.print(device->deviceModel);
+      Serial.print(" \"");
+      Serial.print(device->deviceLabel);
+      Serial.print("\" at ");
+      Serial.print(device->startAddress);
+      Serial.print(", footprint ");
+      Serial.println(device->footprint);
+      break;
+    case RdmInventoryEvent::INVENTORY_DEVICE_REMOVED:
+      printUid(device->uid);
+      Serial.println(" removed");
+      break;
+    case RdmInventoryEvent::INVENTORY_COMPLETE:
+      Serial.println("Inventory complete");
+      break;
+  }
+}
+
+void uidEvent(RdmUidEvent event, const byte *uid) {
+  if (event == RdmUidEvent::UID_EVENT_ADDED) {
+    Serial.print("Found ");
+  } else {
+    Serial.print("Lost ");
+  }
+  printUid(uid);
+  Serial.println("");
+}
+
+void discoveryProgress(const RdmDiscoveryStats& stats) {
+  Serial.print("Discovery: ");
+  Serial.print(stats.rangesRemaining);
+  Serial.print(" ranges left after ");
+  Serial.print(stats.dubCount);
+  Serial.println(" DUBs");
+}
+
 struct RdmInit rdmData {
   myUid,
   0x00000100,
@@ -95,75 +170,27 @@ struct RdmInit rdmData {
   0,  // Additional commands length for RDM
   0,   // Definition of additional commands
   &discoveryComplete,
-  &printRdm
+  &printRdm,
+  &uidEvent,
+  &discoveryProgress
 };
 
 TeensyDmx Dmx(Serial1, &rdmData, DMX_REDE);
+RdmInventory Inventory(Dmx, &inventoryEvent);
 
 byte DMXVal[] = {50};
 
 void setup() {
   Dmx.setMode(TeensyDmx::DMX_OUT);
+  // Remember the UIDs we find across reboots
+  Dmx.setRDMUidStorage(0);
+  // Check for devices coming and going every minute
+  //Dmx.setRDMDiscoveryInterval(60000);
+  Dmx.doRDMWarmStartDiscovery();
 }
 
 void loop() {
   //Dmx.setChannels(0, DMXVal, 1);
-  switch (currentState)
-  {
-    case DISCOVERY:
-      Dmx.doRDMDiscovery();
-      currentState = DISCOVERY_IDLE;
-      break;
-    case DISCOVERY_IDLE:
-      //if ((millis() - lastAction) > 1000) {
-      //  currentState = DISCOVERY;
-      //}
-      break;
-    case SWITCH_UID:
-      if (uidNum > 0) {
-        // Move onto the next UID
-        --uidNum;
-        memcpy(theirUid, &foundUids[(uidNum * RDM_UID_LENGTH)], RDM_UID_LENGTH);
-
-        Serial.print("Fetching info for ");
-        for(int i = 0; i < RDM_UID_LENGTH; i++)
-        {
-          Serial.print(theirUid[i], HEX);
-          if ((i + 1) < RDM_UID_LENGTH) {
-            // Don't print a colon after the last byte
-            Serial.print(":");
-          }
-        }
-        Serial.println("");
-      }
-      currentState = IDENTIFY_ON;
-      break;
-    case IDENTIFY_ON:
-      lastAction = millis();
-      //Dmx.sendRDMSetIdentifyDevice(theirUid, true);
-      Dmx.sendRDMGetManufacturerLabel(theirUid);
-      currentState = IDENTIFY_ON_IDLE;
-      break;
-    case IDENTIFY_ON_IDLE:
-      if ((millis() - lastAction) > 1000) {
-        currentState = IDENTIFY_OFF;
-      }
-      break;
-    case IDENTIFY_OFF:
-      lastAction = millis();
-      //Dmx.sendRDMSetIdentifyDevice(theirUid, false);
-      Dmx.sendRDMGetDeviceModelDescription(theirUid);
-      currentState = IDENTIFY_OFF_IDLE;
-      break;
-    case IDENTIFY_OFF_IDLE:
-      if ((millis() - lastAction) > 1000) {
-        if (uidNum > 0) {
-          currentState = SWITCH_UID;
-        } else {
-          //currentState = IDENTIFY_ON;
-        }
-      }
-      break;
-  }
   Dmx.loop();
+  Inventory.loop();
 }
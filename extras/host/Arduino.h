@@ -0,0 +1,214 @@
+/* TeensyDmx - host build of the parts of the Teensyduino core we use
+
+   Just enough of Arduino.h and kinetis.h for TeensyDmx.cpp to build
+   unmodified on Linux. Time is virtual and the UARTs are ends of the
+   simulated RS-485 line in SimBus.h, so nothing here touches real hardware.
+*/
+
+#ifndef TEENSYDMX_HOST_ARDUINO_H
+#define TEENSYDMX_HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <iostream>
+
+typedef uint8_t byte;
+
+#define INPUT 0
+#define OUTPUT 1
+#define LOW 0
+#define HIGH 1
+#define DEC 10
+#define HEX 16
+
+#define SERIAL_8N2 0x04
+#define SERIAL_8E1 0x06
+
+// Behave like a Teensy 3.5/3.6, all six UARTs and no receive FIFOs, so the
+// simulated bus can hand each byte straight to the status interrupt
+#define KINETISK
+#define HAS_KINETISK_UART3
+#define HAS_KINETISK_UART4
+#define HAS_KINETISK_UART5
+
+enum IRQ_NUMBER_t {
+    IRQ_UART0_STATUS, IRQ_UART0_ERROR,
+    IRQ_UART1_STATUS, IRQ_UART1_ERROR,
+    IRQ_UART2_STATUS, IRQ_UART2_ERROR,
+    IRQ_UART3_STATUS, IRQ_UART3_ERROR,
+    IRQ_UART4_STATUS, IRQ_UART4_ERROR,
+    IRQ_UART5_STATUS, IRQ_UART5_ERROR,
+    NVIC_NUM_INTERRUPTS
+};
+
+// UART registers are plain bytes, SimBus fills in S1 and D before calling
+// the status interrupt
+struct HostUartRegisters
+{
+    volatile uint8_t s1;
+    volatile uint8_t d;
+    volatile uint8_t c2;
+    volatile uint8_t c3;
+    volatile uint8_t rwfifo;
+    volatile uint8_t rcfifo;
+    volatile uint8_t cfifo;
+    volatile uint8_t modem;
+};
+extern HostUartRegisters hostUartRegisters[6];
+
+#define UART0_S1 (hostUartRegisters[0].s1)
+#define UART0_D (hostUartRegisters[0].d)
+#define UART0_C2 (hostUartRegisters[0].c2)
+#define UART0_C3 (hostUartRegisters[0].c3)
+#define UART0_RWFIFO (hostUartRegisters[0].rwfifo)
+#define UART0_RCFIFO (hostUartRegisters[0].rcfifo)
+#define UART0_CFIFO (hostUartRegisters[0].cfifo)
+#define UART0_MODEM (hostUartRegisters[0].modem)
+#define UART1_S1 (hostUartRegisters[1].s1)
+#define UART1_D (hostUartRegisters[1].d)
+#define UART1_C2 (hostUartRegisters[1].c2)
+#define UART1_C3 (hostUartRegisters[1].c3)
+#define UART1_RWFIFO (hostUartRegisters[1].rwfifo)
+#define UART1_RCFIFO (hostUartRegisters[1].rcfifo)
+#define UART1_CFIFO (hostUartRegisters[1].cfifo)
+#define UART1_MODEM (hostUartRegisters[1].modem)
+#define UART2_S1 (hostUartRegisters[2].s1)
+#define UART2_D (hostUartRegisters[2].d)
+#define UART2_C2 (hostUartRegisters[2].c2)
+#define UART2_C3 (hostUartRegisters[2].c3)
+#define UART2_RWFIFO (hostUartRegisters[2].rwfifo)
+#define UART2_RCFIFO (hostUartRegisters[2].rcfifo)
+#define UART2_CFIFO (hostUartRegisters[2].cfifo)
+#define UART2_MODEM (hostUartRegisters[2].modem)
+#define UART3_S1 (hostUartRegisters[3].s1)
+#define UART3_D (hostUartRegisters[3].d)
+#define UART3_C2 (hostUartRegisters[3].c2)
+#define UART3_C3 (hostUartRegisters[3].c3)
+#define UART3_RWFIFO (hostUartRegisters[3].rwfifo)
+#define UART3_RCFIFO (hostUartRegisters[3].rcfifo)
+#define UART3_CFIFO (hostUartRegisters[3].cfifo)
+#define UART3_MODEM (hostUartRegisters[3].modem)
+#define UART4_S1 (hostUartRegisters[4].s1)
+#define UART4_D (hostUartRegisters[4].d)
+#define UART4_C2 (hostUartRegisters[4].c2)
+#define UART4_C3 (hostUartRegisters[4].c3)
+#define UART4_RWFIFO (hostUartRegisters[4].rwfifo)
+#define UART4_RCFIFO (hostUartRegisters[4].rcfifo)
+#define UART4_CFIFO (hostUartRegisters[4].cfifo)
+#define UART4_MODEM (hostUartRegisters[4].modem)
+#define UART5_S1 (hostUartRegisters[5].s1)
+#define UART5_D (hostUartRegisters[5].d)
+#define UART5_C2 (hostUartRegisters[5].c2)
+#define UART5_C3 (hostUartRegisters[5].c3)
+#define UART5_RWFIFO (hostUartRegisters[5].rwfifo)
+#define UART5_RCFIFO (hostUartRegisters[5].rcfifo)
+#define UART5_CFIFO (hostUartRegisters[5].cfifo)
+#define UART5_MODEM (hostUartRegisters[5].modem)
+
+#define UART_S1_TC 0x40
+#define UART_S1_RDRF 0x20
+#define UART_S1_IDLE 0x10
+#define UART_S1_OR 0x08
+#define UART_S1_NF 0x04
+#define UART_S1_FE 0x02
+#define UART_S1_PF 0x01
+#define UART_C2_TCIE 0x40
+#define UART_C2_RIE 0x20
+#define UART_C2_ILIE 0x10
+#define UART_C3_FEIE 0x02
+#define UART_CFIFO_RXFLUSH 0x40
+#define UART_MODEM_TXRTSE 0x02
+#define UART_MODEM_TXRTSPOL 0x04
+
+#define PORT_PCR_MUX(n) ((n) << 8)
+#define PORT_PCR_DSE 0x40
+#define PORT_PCR_SRE 0x04
+
+// There's only one thread, interrupts are called from SimBus
+#define __disable_irq() do {} while (0)
+#define __enable_irq() do {} while (0)
+#define NVIC_ENABLE_IRQ(n) ((void)(n))
+#define NVIC_DISABLE_IRQ(n) ((void)(n))
+#define NVIC_SET_PRIORITY(n, p) ((void)(n), (void)(p))
+#define NVIC_GET_PRIORITY(n) (0)
+
+// No cycle counter here, so TEENSYDMX_PROFILING counts nanoseconds of real
+// time instead
+extern volatile uint32_t hostDebugRegisters[2];
+uint32_t hostCycleCount();
+#define ARM_DEMCR (hostDebugRegisters[0])
+#define ARM_DEMCR_TRCENA (1 << 24)
+#define ARM_DWT_CTRL (hostDebugRegisters[1])
+#define ARM_DWT_CTRL_CYCCNTENA (1 << 0)
+#define ARM_DWT_CYCCNT (hostCycleCount())
+
+void attachInterruptVector(IRQ_NUMBER_t irq, void (*isr)(void));
+
+// Virtual time, advanced by SimBus
+uint32_t millis();
+uint32_t micros();
+void delayMicroseconds(uint32_t us);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+volatile uint8_t* portOutputRegister(uint8_t pin);
+volatile uint32_t* portConfigRegister(uint8_t pin);
+
+// A UART on the simulated line, or the console for Serial
+class HardwareSerial
+{
+  public:
+    explicit HardwareSerial(int8_t uart) :
+        m_uart(uart)
+    { }
+
+    void begin(uint32_t baud, uint32_t format = 0);
+    void end();
+    size_t write(uint8_t c);
+    size_t write(const uint8_t *buffer, size_t size);
+    void flush();
+
+    // The console only, nothing is printed for UARTs
+    template <typename T> void print(T value) {
+        if (m_uart < 0) {
+            std::cout << value;
+        }
+    }
+    template <typename T> void print(T value, int base) {
+        if (m_uart < 0) {
+            std::cout << (base == HEX ? std::hex : std::dec) << +value << std::dec;
+        }
+    }
+    template <typename T> void println(T value) {
+        print(value);
+        println();
+    }
+    template <typename T> void println(T value, int base) {
+        print(value, base);
+        println();
+    }
+    void println() {
+        if (m_uart < 0) {
+            std::cout << std::endl;
+        }
+    }
+
+    int8_t uart() const {
+        return m_uart;
+    }
+
+  private:
+    int8_t m_uart;  // -1 for the console
+};
+
+extern HardwareSerial Serial;
+extern HardwareSerial Serial1;
+extern HardwareSerial Serial2;
+extern HardwareSerial Serial3;
+extern HardwareSerial Serial4;
+extern HardwareSerial Serial5;
+extern HardwareSerial Serial6;
+
+#endif  // TEENSYDMX_HOST_ARDUINO_H
@@ -0,0 +1,165 @@
+/* TeensyDmx - host build of the parts of the Teensyduino core we use
+*/
+
+// PlatformIO builds everything under the library, this is for the host only
+#ifndef TEENSYDUINO
+
+#include "Arduino.h"
+#include "SimBus.h"
+#include <avr/eeprom.h>
+
+#include <chrono>
+
+namespace {
+
+enum { PIN_COUNT = 64 };
+
+volatile uint8_t pinOutputs[PIN_COUNT];
+volatile uint32_t pinConfigs[PIN_COUNT];
+uint8_t eeprom[E2END + 1];
+bool eepromErased = false;
+
+uint8_t* eepromAddress(const void *address)
+{
+    if (!eepromErased) {
+        // Blank like a new part
+        memset(eeprom, 0xff, sizeof(eeprom));
+        eepromErased = true;
+    }
+    return &eeprom[reinterpret_cast<uintptr_t>(address) & E2END];
+}
+
+}  // anon namespace
+
+HostUartRegisters hostUartRegisters[6];
+
+HardwareSerial Serial(-1);
+HardwareSerial Serial1(0);
+HardwareSerial Serial2(1);
+HardwareSerial Serial3(2);
+HardwareSerial Serial4(3);
+HardwareSerial Serial5(4);
+HardwareSerial Serial6(5);
+
+void HardwareSerial::begin(uint32_t baud, uint32_t format)
+{
+    (void) format;
+    if (m_uart >= 0) {
+        SimBus::instance().uartBegin(m_uart, baud);
+    }
+}
+
+void HardwareSerial::end()
+{
+    if (m_uart >= 0) {
+        SimBus::instance().uartEnd(m_uart);
+    }
+}
+
+size_t HardwareSerial::write(uint8_t c)
+{
+    if (m_uart < 0) {
+        std::cout << static_cast<char>(c);
+    } else {
+        SimBus::instance().uartWrite(m_uart, c);
+    }
+    return 1;
+}
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size)
+{
+    for (size_t i = 0; i < size; ++i) {
+        write(buffer[i]);
+    }
+    return size;
+}
+
+void HardwareSerial::flush()
+{
+    if (m_uart < 0) {
+        std::cout.flush();
+    } else {
+        SimBus::instance().uartFlush(m_uart);
+    }
+}
+
+volatile uint32_t hostDebugRegisters[2];
+
+uint32_t hostCycleCount()
+{
+    return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+void attachInterruptVector(IRQ_NUMBER_t irq, void (*isr)(void))
+{
+    SimBus::instance().attachVector(irq, isr);
+}
+
+uint32_t millis()
+{
+    return SimBus::instance().now() / 1000;
+}
+
+uint32_t micros()
+{
+    return static_cast<uint32_t>(SimBus::instance().now());
+}
+
+void delayMicroseconds(uint32_t us)
+{
+    SimBus::instance().advance(us);
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+    (void) pin;
+    (void) mode;
+}
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+    pinOutputs[pin % PIN_COUNT] = value;
+}
+
+volatile uint8_t* portOutputRegister(uint8_t pin)
+{
+    return &pinOutputs[pin % PIN_COUNT];
+}
+
+volatile uint32_t* portConfigRegister(uint8_t pin)
+{
+    return &pinConfigs[pin % PIN_COUNT];
+}
+
+// The core's own serial interrupts, put back when TeensyDmx is stopped
+void uart0_status_isr() { }
+void uart0_error_isr() { }
+void uart1_status_isr() { }
+void uart1_error_isr() { }
+void uart2_status_isr() { }
+void uart2_error_isr() { }
+void uart3_status_isr() { }
+void uart3_error_isr() { }
+void uart4_status_isr() { }
+void uart4_error_isr() { }
+void uart5_status_isr() { }
+void uart5_error_isr() { }
+
+void eeprom_read_block(void *dst, const void *src, size_t n)
+{
+    uint8_t *target = reinterpret_cast<uint8_t*>(dst);
+    for (size_t i = 0; i < n; ++i) {
+        target[i] = *eepromAddress(reinterpret_cast<const uint8_t*>(src) + i);
+    }
+}
+
+void eeprom_write_block(const void *src, void *dst, size_t n)
+{
+    const uint8_t *source = reinterpret_cast<const uint8_t*>(src);
+    for (size_t i = 0; i < n; ++i) {
+        *eepromAddress(reinterpret_cast<uint8_t*>(dst) + i) = source[i];
+    }
+}
+
+#endif  // TEENSYDUINO
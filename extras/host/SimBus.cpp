@@ -0,0 +1,302 @@
+/* TeensyDmx - simulated half-duplex RS-485 line for host builds
+*/
+
+// PlatformIO builds everything under the library, this is for the host only
+#ifndef TEENSYDUINO
+
+#include "SimBus.h"
+#include "SimResponder.h"
+
+#include <algorithm>
+
+namespace {
+
+// 8N2 and 8E1 are both 11 bits a character
+enum { BITS_PER_CHARACTER = 11 };
+// Start, 8 data and the even parity bit of a zero are all low
+enum { BREAK_LOW_BITS = 10 };
+enum { DMX_BAUD = 250000 };
+enum { GARBLE_SEED = 0x2545f491 };
+
+uint64_t bitsToMicros(uint32_t bits, uint32_t baud)
+{
+    return (static_cast<uint64_t>(bits) * 1000000 + baud - 1) / baud;
+}
+
+}  // anon namespace
+
+SimBus& SimBus::instance()
+{
+    static SimBus bus;
+    return bus;
+}
+
+SimBus::SimBus() :
+    m_now(0),
+    m_uarts(),
+    m_vectors(),
+    m_events(),
+    m_responders(),
+    m_stats(),
+    m_collisionModel(COLLISION_AND),
+    m_garbleState(GARBLE_SEED)
+{ }
+
+uint64_t SimBus::now() const
+{
+    return m_now;
+}
+
+void SimBus::advance(uint32_t duration)
+{
+    runUntil(m_now + duration);
+}
+
+void SimBus::run(uint32_t duration, void (*loop)(), uint32_t step, bool (*done)())
+{
+    uint64_t end = m_now + duration;
+    while (m_now < end) {
+        if (loop != nullptr) {
+            loop();
+        }
+        if (done != nullptr && done()) {
+            return;
+        }
+        runUntil(std::min(m_now + step, end));
+    }
+}
+
+void SimBus::reset()
+{
+    m_now = 0;
+    m_events.clear();
+    m_responders.clear();
+    m_stats = SimBusStats();
+    m_garbleState = GARBLE_SEED;
+    for (uint8_t i = 0; i < UART_COUNT; ++i) {
+        m_uarts[i].busyUntil = 0;
+    }
+}
+
+void SimBus::addResponder(SimResponder& responder)
+{
+    m_responders.push_back(&responder);
+}
+
+void SimBus::removeResponder(SimResponder& responder)
+{
+    m_responders.erase(std::remove(m_responders.begin(), m_responders.end(), &responder),
+                       m_responders.end());
+}
+
+const SimBusStats& SimBus::getStats() const
+{
+    return m_stats;
+}
+
+void SimBus::setCollisionModel(CollisionModel model)
+{
+    m_collisionModel = model;
+}
+
+SimBus::CollisionModel SimBus::getCollisionModel() const
+{
+    return m_collisionModel;
+}
+
+void SimBus::inject(uint8_t uart, uint8_t s1, uint8_t d)
+{
+    raiseStatus(uart, s1, d);
+}
+
+void SimBus::uartBegin(uint8_t uart, uint32_t baud)
+{
+    m_uarts[uart].open = true;
+    m_uarts[uart].baud = baud;
+}
+
+void SimBus::uartEnd(uint8_t uart)
+{
+    m_uarts[uart].open = false;
+}
+
+void SimBus::uartWrite(uint8_t uart, uint8_t c)
+{
+    Uart& port = m_uarts[uart];
+    if (!port.open) {
+        return;
+    }
+    uint64_t start = std::max(m_now, port.busyUntil);
+    uint64_t end = start + bitsToMicros(BITS_PER_CHARACTER, port.baud);
+    port.busyUntil = end;
+    // The transmitter is busy again until the complete event
+    hostUartRegisters[uart].s1 &= ~UART_S1_TC;
+    if (c == 0 && port.baud < DMX_BAUD) {
+        // Long enough low to be a break, which a receiver sees as a framing
+        // error about a character's time into it
+        Event event = Event();
+        event.start = start;
+        event.time = start + bitsToMicros(BREAK_LOW_BITS, DMX_BAUD);
+        event.type = EVENT_BREAK;
+        event.senders.insert(&m_uarts[uart]);
+        schedule(event);
+    } else {
+        scheduleByte(&m_uarts[uart], start, end, c);
+    }
+    Event complete = Event();
+    complete.start = end;
+    complete.time = end;
+    complete.type = EVENT_TX_COMPLETE;
+    complete.uart = uart;
+    schedule(complete);
+}
+
+void SimBus::uartFlush(uint8_t uart)
+{
+    if (m_uarts[uart].busyUntil > m_now) {
+        runUntil(m_uarts[uart].busyUntil);
+    }
+}
+
+void SimBus::attachVector(IRQ_NUMBER_t irq, void (*isr)())
+{
+    m_vectors[irq] = isr;
+}
+
+void SimBus::responderSend(SimResponder& responder, const uint8_t *data, uint16_t length,
+                           uint32_t delay, uint32_t breakTime, uint32_t mabTime)
+{
+    uint64_t start = m_now + delay;
+    if (breakTime > 0) {
+        Event event = Event();
+        event.start = start;
+        event.time = start + std::min<uint64_t>(breakTime, BYTE_TIME);
+        event.type = EVENT_BREAK;
+        event.senders.insert(&responder);
+        schedule(event);
+        start += breakTime + mabTime;
+    }
+    for (uint16_t i = 0; i < length; ++i) {
+        scheduleByte(&responder, start, start + BYTE_TIME, data[i]);
+        start += BYTE_TIME;
+    }
+}
+
+void SimBus::schedule(const Event& event)
+{
+    // Keep events in time order, and in the order they were scheduled when
+    // they're due together
+    std::vector<Event>::iterator position = m_events.begin();
+    while (position != m_events.end() && position->time <= event.time) {
+        ++position;
+    }
+    m_events.insert(position, event);
+}
+
+void SimBus::scheduleByte(const void *sender, uint64_t start, uint64_t end, uint8_t value)
+{
+    for (size_t i = 0; i < m_events.size(); ++i) {
+        Event& event = m_events[i];
+        if (event.type == EVENT_BYTE && event.senders.count(sender) == 0 &&
+                start < event.time && event.start < end) {
+            // Two drivers at once
+            switch (m_collisionModel)
+            {
+                case COLLISION_AND:
+                    event.value &= value;
+                    break;
+                case COLLISION_OR:
+                    event.value |= value;
+                    break;
+                case COLLISION_GARBLED:
+                    // xorshift32, so it's repeatable
+                    m_garbleState ^= m_garbleState << 13;
+                    m_garbleState ^= m_garbleState >> 17;
+                    m_garbleState ^= m_garbleState << 5;
+                    event.value = m_garbleState & 0xff;
+                    break;
+            }
+            event.collided = true;
+            event.senders.insert(sender);
+            return;
+        }
+    }
+    Event event = Event();
+    event.start = start;
+    event.time = end;
+    event.type = EVENT_BYTE;
+    event.value = value;
+    event.senders.insert(sender);
+    schedule(event);
+}
+
+void SimBus::runUntil(uint64_t time)
+{
+    while (!m_events.empty() && m_events.front().time <= time) {
+        Event event = m_events.front();
+        m_events.erase(m_events.begin());
+        if (event.time > m_now) {
+            m_now = event.time;
+        }
+        dispatch(event);
+    }
+    if (time > m_now) {
+        m_now = time;
+    }
+}
+
+void SimBus::dispatch(const Event& event)
+{
+    switch (event.type)
+    {
+        case EVENT_BYTE:
+            ++m_stats.bytes;
+            if (event.collided) {
+                ++m_stats.collisions;
+            }
+            for (uint8_t i = 0; i < UART_COUNT; ++i) {
+                if (m_uarts[i].open && m_uarts[i].baud == DMX_BAUD &&
+                        event.senders.count(&m_uarts[i]) == 0) {
+                    raiseStatus(i, UART_S1_RDRF, event.value);
+                }
+            }
+            for (size_t i = 0; i < m_responders.size(); ++i) {
+                if (event.senders.count(m_responders[i]) == 0) {
+                    m_responders[i]->onByte(event.value);
+                }
+            }
+            break;
+        case EVENT_BREAK:
+            ++m_stats.breaks;
+            for (uint8_t i = 0; i < UART_COUNT; ++i) {
+                if (m_uarts[i].open && m_uarts[i].baud == DMX_BAUD &&
+                        event.senders.count(&m_uarts[i]) == 0) {
+                    raiseStatus(i, UART_S1_FE, 0);
+                }
+            }
+            for (size_t i = 0; i < m_responders.size(); ++i) {
+                if (event.senders.count(m_responders[i]) == 0) {
+                    m_responders[i]->onBreak();
+                }
+            }
+            break;
+        case EVENT_TX_COMPLETE:
+            // Only once everything written has gone
+            if (m_uarts[event.uart].busyUntil <= m_now) {
+                raiseStatus(event.uart, UART_S1_TC, 0);
+            }
+            break;
+    }
+}
+
+void SimBus::raiseStatus(uint8_t uart, uint8_t s1, uint8_t d)
+{
+    hostUartRegisters[uart].s1 = s1;
+    hostUartRegisters[uart].d = d;
+    void (*isr)() = m_vectors[IRQ_UART0_STATUS + (uart * 2)];
+    if (isr != nullptr) {
+        isr();
+    }
+}
+
+#endif  // TEENSYDUINO
@@ -0,0 +1,127 @@
+/* TeensyDmx - simulated half-duplex RS-485 line for host builds
+
+   Every UART (Serial1 to Serial6) and any number of SimResponders share one
+   line. Bytes take as long as they would at their baud rate in virtual
+   time, a break is a zero sent below 250k baud, and the receiving UARTs see
+   each byte, or a framing error for a break, through their status
+   interrupt just as on a Teensy. Overlapping bytes are merged by the
+   collision model. Nothing happens until advance() is called, so a run is
+   the same every time.
+*/
+
+#ifndef TEENSYDMX_HOST_SIMBUS_H
+#define TEENSYDMX_HOST_SIMBUS_H
+
+#include "Arduino.h"
+
+#include <set>
+#include <vector>
+
+class SimResponder;
+
+struct SimBusStats
+{
+    uint32_t bytes;  // Bytes seen on the line, merged ones counted once
+    uint32_t breaks;
+    uint32_t collisions;  // Bytes where more than one sender overlapped
+};
+
+class SimBus
+{
+  public:
+    enum { UART_COUNT = 6 };
+    // The line at 250k baud 8N2
+    enum { BYTE_TIME = 44 };
+
+    // What the receivers see when two senders overlap. Real transceivers
+    // differ, so the discovery code shouldn't rely on any one of these.
+    enum CollisionModel {
+        COLLISION_AND,  // A zero from either wins, as a dominant low
+        COLLISION_OR,  // A one from either wins, as a wired-OR line
+        COLLISION_GARBLED  // Some unrelated value, the same every run
+    };
+
+    static SimBus& instance();
+
+    // Virtual time in microseconds since the start, or the last reset()
+    uint64_t now() const;
+    // Run everything due in the next duration microseconds, calling the
+    // interrupts it raises, then leave the clock there
+    void advance(uint32_t duration);
+    // Advance in steps of step microseconds, calling loop after each, for
+    // duration microseconds or until done returns true
+    void run(uint32_t duration, void (*loop)(), uint32_t step = 10,
+             bool (*done)() = nullptr);
+    // Forget everything in flight, the responders and the stats, and start
+    // the clock again from zero
+    void reset();
+
+    void addResponder(SimResponder& responder);
+    void removeResponder(SimResponder& responder);
+
+    const SimBusStats& getStats() const;
+
+    // COLLISION_AND by default, kept across reset()
+    void setCollisionModel(CollisionModel model);
+    CollisionModel getCollisionModel() const;
+
+    // Hand a byte (UART_S1_RDRF) or a break (UART_S1_FE) straight to a
+    // UART's status interrupt, skipping the line and the clock, to feed a
+    // receiver as fast as it will go
+    void inject(uint8_t uart, uint8_t s1, uint8_t d = 0);
+
+    // Called by the host core
+    void uartBegin(uint8_t uart, uint32_t baud);
+    void uartEnd(uint8_t uart);
+    void uartWrite(uint8_t uart, uint8_t c);
+    void uartFlush(uint8_t uart);
+    void attachVector(IRQ_NUMBER_t irq, void (*isr)());
+
+    // Called by responders. A break of breakTime microseconds and a mark
+    // after break of mabTime go first unless breakTime is 0. Transmission
+    // starts delay microseconds from now.
+    void responderSend(SimResponder& responder, const uint8_t *data, uint16_t length,
+                       uint32_t delay, uint32_t breakTime = 176, uint32_t mabTime = 12);
+
+  private:
+    SimBus();
+    SimBus(const SimBus&);
+    SimBus& operator=(const SimBus&);
+
+    enum EventType { EVENT_BYTE, EVENT_BREAK, EVENT_TX_COMPLETE };
+
+    struct Event
+    {
+        uint64_t start;
+        uint64_t time;  // When it's delivered, the end of the byte
+        EventType type;
+        uint8_t value;
+        int8_t uart;  // For EVENT_TX_COMPLETE
+        bool collided;
+        std::set<const void*> senders;
+    };
+
+    struct Uart
+    {
+        bool open;
+        uint32_t baud;
+        uint64_t busyUntil;
+    };
+
+    void schedule(const Event& event);
+    void scheduleByte(const void *sender, uint64_t start, uint64_t end, uint8_t value);
+    void dispatch(const Event& event);
+    void raiseStatus(uint8_t uart, uint8_t s1, uint8_t d);
+    void runUntil(uint64_t time);
+
+    uint64_t m_now;
+    Uart m_uarts[UART_COUNT];
+    void (*m_vectors[NVIC_NUM_INTERRUPTS])();
+    std::vector<Event> m_events;
+    std::vector<SimResponder*> m_responders;
+    SimBusStats m_stats;
+    CollisionModel m_collisionModel;
+    uint32_t m_garbleState;
+};
+
+#endif  // TEENSYDMX_HOST_SIMBUS_H
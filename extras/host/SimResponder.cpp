@@ -0,0 +1,406 @@
+/* TeensyDmx - a simulated RDM responder for host builds
+*/
+
+// PlatformIO builds everything under the library, this is for the host only
+#ifndef TEENSYDUINO
+
+#include "SimResponder.h"
+#include "SimBus.h"
+#include "rdm.h"
+
+namespace {
+
+// Everything before the parameter data, and the checksum after it
+enum { RDM_HEADER_SIZE = 24 };
+enum { RDM_CHECKSUM_SIZE = 2 };
+enum { DEVICE_INFO_SIZE = 19 };
+enum { SENSOR_VALUE_SIZE = 9 };
+enum { DUB_RESPONSE_SIZE = 24 };
+
+inline uint16_t getUInt16(const byte* const buffer)
+{
+    return (buffer[0] << 8) | buffer[1];
+}
+
+inline void putUInt16(void* const buffer, const uint16_t value)
+{
+    reinterpret_cast<byte*>(buffer)[0] = value >> 8;
+    reinterpret_cast<byte*>(buffer)[1] = value & 0xff;
+}
+
+inline void putUInt32(void* const buffer, const uint32_t value)
+{
+    putUInt16(buffer, value >> 16);
+    putUInt16(reinterpret_cast<byte*>(buffer) + 2, value & 0xffff);
+}
+
+}  // anon namespace
+
+SimResponder::SimResponder(const byte *uid)
+{
+    memcpy(m_uid, uid, RDM_UID_LENGTH);
+    init();
+}
+
+SimResponder::SimResponder(uint64_t uid)
+{
+    for (byte i = 0; i < RDM_UID_LENGTH; ++i) {
+        m_uid[i] = (uid >> (8 * (RDM_UID_LENGTH - 1 - i))) & 0xff;
+    }
+    init();
+}
+
+void SimResponder::init()
+{
+    memset(&m_request, 0, sizeof(m_request));
+    memset(&m_response, 0, sizeof(m_response));
+    m_received = 0;
+    m_receiving = false;
+    m_muted = false;
+    m_identifying = false;
+    m_requestCount = 0;
+    m_responseDelay = DEFAULT_RESPONSE_DELAY;
+    setLabel(m_deviceLabel, "");
+    setLabel(m_manufacturerLabel, "TeensyDmx");
+    setLabel(m_modelDescription, "Simulated responder");
+    m_startAddress = 1;
+    m_footprint = 1;
+    m_sensorValue = 0;
+    m_sensorLowest = 0;
+    m_sensorHighest = 0;
+}
+
+const byte* SimResponder::uid() const
+{
+    return m_uid;
+}
+
+bool SimResponder::isMuted() const
+{
+    return m_muted;
+}
+
+bool SimResponder::isIdentifying() const
+{
+    return m_identifying;
+}
+
+uint32_t SimResponder::getRequestCount() const
+{
+    return m_requestCount;
+}
+
+void SimResponder::setResponseDelay(uint32_t delay)
+{
+    m_responseDelay = delay;
+}
+
+void SimResponder::setDeviceLabel(const char *label)
+{
+    setLabel(m_deviceLabel, label);
+}
+
+void SimResponder::setManufacturerLabel(const char *label)
+{
+    setLabel(m_manufacturerLabel, label);
+}
+
+void SimResponder::setModelDescription(const char *description)
+{
+    setLabel(m_modelDescription, description);
+}
+
+void SimResponder::setStartAddress(uint16_t address)
+{
+    m_startAddress = address;
+}
+
+uint16_t SimResponder::getStartAddress() const
+{
+    return m_startAddress;
+}
+
+void SimResponder::setFootprint(uint16_t footprint)
+{
+    m_footprint = footprint;
+}
+
+void SimResponder::setSensorValue(int16_t value)
+{
+    m_sensorValue = value;
+    if (value < m_sensorLowest) {
+        m_sensorLowest = value;
+    }
+    if (value > m_sensorHighest) {
+        m_sensorHighest = value;
+    }
+}
+
+void SimResponder::onBreak()
+{
+    m_receiving = true;
+    m_received = 0;
+}
+
+void SimResponder::onByte(byte value)
+{
+    if (!m_receiving) {
+        return;
+    }
+    byte *buffer = m_request.raw;
+    buffer[m_received++] = value;
+    if (m_received == 1 && value != E120_SC_RDM) {
+        // DMX, or anything else that isn't for us
+        m_receiving = false;
+    } else if (m_received == 2 && value != E120_SC_SUB_MESSAGE) {
+        m_receiving = false;
+    } else if (m_received == 3 && value < RDM_HEADER_SIZE) {
+        m_receiving = false;
+    } else if (m_received > 3 && m_received == m_request.rdm.length + RDM_CHECKSUM_SIZE) {
+        m_receiving = false;
+        if (m_request.rdm.dataLength == m_request.rdm.length - RDM_HEADER_SIZE &&
+                checksum(buffer, m_request.rdm.length) == getUInt16(&buffer[m_request.rdm.length])) {
+            handleRequest();
+        }
+    }
+}
+
+void SimResponder::handleRequest()
+{
+    if (!isForMe()) {
+        return;
+    }
+    ++m_requestCount;
+
+    if (m_request.rdm.cmdClass == E120_DISCOVERY_COMMAND) {
+        handleDiscovery();
+        return;
+    }
+    if (getUInt16(reinterpret_cast<const byte*>(&m_request.rdm.subDev)) != 0) {
+        respondNack(E120_NR_SUB_DEVICE_OUT_OF_RANGE);
+        return;
+    }
+
+    bool get = (m_request.rdm.cmdClass == E120_GET_COMMAND);
+    bool set = (m_request.rdm.cmdClass == E120_SET_COMMAND);
+    if (!get && !set) {
+        respondNack(E120_NR_UNSUPPORTED_COMMAND_CLASS);
+        return;
+    }
+
+    uint16_t parameter = getUInt16(reinterpret_cast<const byte*>(&m_request.rdm.parameter));
+    switch (parameter)
+    {
+        case E120_DEVICE_INFO:
+            if (!get) {
+                respondNack(E120_NR_UNSUPPORTED_COMMAND_CLASS);
+            } else {
+                byte info[DEVICE_INFO_SIZE] = {0};
+                info[0] = 1;  // Protocol 1.0
+                putUInt16(&info[2], 1);  // Model
+                putUInt16(&info[4], E120_PRODUCT_CATEGORY_FIXTURE);
+                putUInt32(&info[6], 1);  // Software version
+                putUInt16(&info[10], m_footprint);
+                info[12] = 1;  // Current personality
+                info[13] = 1;  // Personality count
+                putUInt16(&info[14], m_startAddress);
+                info[18] = 1;  // Sensor count
+                respondAck(info, sizeof(info));
+            }
+            break;
+        case E120_DEVICE_LABEL:
+            if (get) {
+                respondAck(m_deviceLabel, strlen(m_deviceLabel));
+            } else if (m_request.rdm.dataLength > MAX_LABEL_LENGTH) {
+                respondNack(E120_NR_FORMAT_ERROR);
+            } else {
+                memcpy(m_deviceLabel, m_request.rdm.data, m_request.rdm.dataLength);
+                m_deviceLabel[m_request.rdm.dataLength] = '\0';
+                respondAck(nullptr, 0);
+            }
+            break;
+        case E120_MANUFACTURER_LABEL:
+            if (!get) {
+                respondNack(E120_NR_UNSUPPORTED_COMMAND_CLASS);
+            } else {
+                respondAck(m_manufacturerLabel, strlen(m_manufacturerLabel));
+            }
+            break;
+        case E120_DEVICE_MODEL_DESCRIPTION:
+            if (!get) {
+                respondNack(E120_NR_UNSUPPORTED_COMMAND_CLASS);
+            } else {
+                respondAck(m_modelDescription, strlen(m_modelDescription));
+            }
+            break;
+        case E120_DMX_START_ADDRESS:
+            if (get) {
+                byte address[2];
+                putUInt16(address, m_startAddress);
+                respondAck(address, sizeof(address));
+            } else if (m_request.rdm.dataLength != 2) {
+                respondNack(E120_NR_FORMAT_ERROR);
+            } else {
+                uint16_t address = getUInt16(m_request.rdm.data);
+                if (address < 1 || address > DMX_UNIVERSE_SIZE) {
+                    respondNack(E120_NR_DATA_OUT_OF_RANGE);
+                } else {
+                    m_startAddress = address;
+                    respondAck(nullptr, 0);
+                }
+            }
+            break;
+        case E120_IDENTIFY_DEVICE:
+            if (get) {
+                byte identifying = m_identifying ? 1 : 0;
+                respondAck(&identifying, 1);
+            } else if (m_request.rdm.dataLength != 1) {
+                respondNack(E120_NR_FORMAT_ERROR);
+            } else if (m_request.rdm.data[0] > 1) {
+                respondNack(E120_NR_DATA_OUT_OF_RANGE);
+            } else {
+                m_identifying = (m_request.rdm.data[0] == 1);
+                respondAck(nullptr, 0);
+            }
+            break;
+        case E120_SENSOR_VALUE:
+            if (m_request.rdm.dataLength != 1) {
+                respondNack(E120_NR_FORMAT_ERROR);
+            } else if (m_request.rdm.data[0] != 0 && !(set && m_request.rdm.data[0] == 0xff)) {
+                respondNack(E120_NR_DATA_OUT_OF_RANGE);
+            } else {
+                if (set) {
+                    m_sensorLowest = m_sensorValue;
+                    m_sensorHighest = m_sensorValue;
+                }
+                byte value[SENSOR_VALUE_SIZE] = {0};
+                putUInt16(&value[1], m_sensorValue);
+                putUInt16(&value[3], m_sensorLowest);
+                putUInt16(&value[5], m_sensorHighest);
+                respondAck(value, sizeof(value));
+            }
+            break;
+        default:
+            respondNack(E120_NR_UNKNOWN_PID);
+            break;
+    }
+}
+
+void SimResponder::handleDiscovery()
+{
+    uint16_t parameter = getUInt16(reinterpret_cast<const byte*>(&m_request.rdm.parameter));
+    switch (parameter)
+    {
+        case E120_DISC_UNIQUE_BRANCH:
+            if (m_muted || m_request.rdm.dataLength != 2 * RDM_UID_LENGTH) {
+                return;
+            }
+            if (memcmp(m_request.rdm.data, m_uid, RDM_UID_LENGTH) <= 0 &&
+                    memcmp(m_uid, &m_request.rdm.data[RDM_UID_LENGTH], RDM_UID_LENGTH) <= 0) {
+                byte response[DUB_RESPONSE_SIZE];
+                for (byte i = 0; i < 7; ++i) {
+                    response[i] = 0xFE;
+                }
+                response[7] = 0xAA;
+                for (byte i = 0; i < RDM_UID_LENGTH; ++i) {
+                    response[8 + i + i] = m_uid[i] | 0xAA;
+                    response[9 + i + i] = m_uid[i] | 0x55;
+                }
+                uint16_t sum = checksum(&response[8], 2 * RDM_UID_LENGTH);
+                response[20] = (sum >> 8) | 0xAA;
+                response[21] = (sum >> 8) | 0x55;
+                response[22] = (sum & 0xFF) | 0xAA;
+                response[23] = (sum & 0xFF) | 0x55;
+                // No break for DUB
+                SimBus::instance().responderSend(*this, response, sizeof(response),
+                                                 m_responseDelay, 0, 0);
+            }
+            break;
+        case E120_DISC_MUTE:
+        case E120_DISC_UN_MUTE:
+            m_muted = (parameter == E120_DISC_MUTE);
+            {
+                byte control[2] = {0};
+                respondAck(control, sizeof(control));
+            }
+            break;
+    }
+}
+
+void SimResponder::respondAck(const void *data, byte length)
+{
+    respond(E120_RESPONSE_TYPE_ACK, data, length);
+}
+
+void SimResponder::respondNack(uint16_t reason)
+{
+    byte data[2];
+    putUInt16(data, reason);
+    respond(E120_RESPONSE_TYPE_NACK_REASON, data, sizeof(data));
+}
+
+void SimResponder::respond(byte responseType, const void *data, byte length)
+{
+    if (isBroadcast()) {
+        // Nobody to answer
+        return;
+    }
+    m_response.rdm.startCode = E120_SC_RDM;
+    m_response.rdm.subStartCode = E120_SC_SUB_MESSAGE;
+    m_response.rdm.length = RDM_HEADER_SIZE + length;
+    memcpy(m_response.rdm.destId, m_request.rdm.sourceId, RDM_UID_LENGTH);
+    memcpy(m_response.rdm.sourceId, m_uid, RDM_UID_LENGTH);
+    m_response.rdm.transNo = m_request.rdm.transNo;
+    m_response.rdm.responseType = responseType;
+    m_response.rdm.messageCount = 0;
+    m_response.rdm.subDev = m_request.rdm.subDev;
+    m_response.rdm.cmdClass = m_request.rdm.cmdClass + 1;
+    m_response.rdm.parameter = m_request.rdm.parameter;
+    m_response.rdm.dataLength = length;
+    if (length > 0) {
+        memcpy(m_response.rdm.data, data, length);
+    }
+    byte packetLength = m_response.rdm.length;
+    uint16_t sum = checksum(m_response.raw, packetLength);
+    m_response.raw[packetLength] = sum >> 8;
+    m_response.raw[packetLength + 1] = sum & 0xff;
+    SimBus::instance().responderSend(*this, m_response.raw, packetLength + RDM_CHECKSUM_SIZE,
+                                     m_responseDelay);
+}
+
+bool SimResponder::isForMe() const
+{
+    if (memcmp(m_request.rdm.destId, m_uid, RDM_UID_LENGTH) == 0) {
+        return true;
+    }
+    // All devices, or all devices from our manufacturer
+    for (byte i = 2; i < RDM_UID_LENGTH; ++i) {
+        if (m_request.rdm.destId[i] != 0xff) {
+            return false;
+        }
+    }
+    return (m_request.rdm.destId[0] == 0xff && m_request.rdm.destId[1] == 0xff) ||
+           (m_request.rdm.destId[0] == m_uid[0] && m_request.rdm.destId[1] == m_uid[1]);
+}
+
+bool SimResponder::isBroadcast() const
+{
+    return memcmp(m_request.rdm.destId, m_uid, RDM_UID_LENGTH) != 0;
+}
+
+void SimResponder::setLabel(char *target, const char *label)
+{
+    strncpy(target, label, MAX_LABEL_LENGTH);
+    target[MAX_LABEL_LENGTH] = '\0';
+}
+
+uint16_t SimResponder::checksum(const byte *data, uint16_t length)
+{
+    uint16_t sum = 0;
+    for (uint16_t i = 0; i < length; ++i) {
+        sum += data[i];
+    }
+    return sum;
+}
+
+#endif  // TEENSYDUINO
@@ -0,0 +1,84 @@
+/* TeensyDmx - a simulated RDM responder for host builds
+
+   Answers discovery and a handful of common PIDs the way a simple fixture
+   would, so a controller can be exercised on the simulated line without any
+   hardware. Anything it doesn't know gets NACK_REASON UNKNOWN_PID.
+*/
+
+#ifndef TEENSYDMX_HOST_SIMRESPONDER_H
+#define TEENSYDMX_HOST_SIMRESPONDER_H
+
+#include "TeensyDmx.h"
+
+class SimResponder
+{
+  public:
+    // Roughly what a responder takes to turn the line around
+    enum { DEFAULT_RESPONSE_DELAY = 200 };
+    enum { MAX_LABEL_LENGTH = 32 };
+
+    explicit SimResponder(const byte *uid);
+    explicit SimResponder(uint64_t uid);
+
+    const byte* uid() const;
+    bool isMuted() const;
+    bool isIdentifying() const;
+    // Valid requests addressed to us, broadcasts included
+    uint32_t getRequestCount() const;
+
+    void setResponseDelay(uint32_t delay);
+    void setDeviceLabel(const char *label);
+    void setManufacturerLabel(const char *label);
+    void setModelDescription(const char *description);
+    void setStartAddress(uint16_t address);
+    uint16_t getStartAddress() const;
+    void setFootprint(uint16_t footprint);
+    // Reported from SENSOR_VALUE for sensor 0
+    void setSensorValue(int16_t value);
+
+    // Called by SimBus
+    void onBreak();
+    void onByte(byte value);
+
+  private:
+    SimResponder(const SimResponder&);
+    SimResponder& operator=(const SimResponder&);
+
+    void init();
+    void handleRequest();
+    void handleDiscovery();
+    void respond(byte responseType, const void *data, byte length);
+    void respondAck(const void *data, byte length);
+    void respondNack(uint16_t reason);
+    bool isForMe() const;
+    bool isBroadcast() const;
+    static void setLabel(char *target, const char *label);
+    static uint16_t checksum(const byte *data, uint16_t length);
+
+    // With room for the checksum after the longest packet
+    union Packet
+    {
+        RdmData rdm;
+        byte raw[sizeof(RdmData) + 2];
+    };
+
+    byte m_uid[RDM_UID_LENGTH];
+    Packet m_request;
+    uint16_t m_received;
+    bool m_receiving;
+    bool m_muted;
+    bool m_identifying;
+    uint32_t m_requestCount;
+    uint32_t m_responseDelay;
+    char m_deviceLabel[MAX_LABEL_LENGTH + 1];
+    char m_manufacturerLabel[MAX_LABEL_LENGTH + 1];
+    char m_modelDescription[MAX_LABEL_LENGTH + 1];
+    uint16_t m_startAddress;
+    uint16_t m_footprint;
+    int16_t m_sensorValue;
+    int16_t m_sensorLowest;
+    int16_t m_sensorHighest;
+    Packet m_response;
+};
+
+#endif  // TEENSYDMX_HOST_SIMRESPONDER_H
@@ -0,0 +1,15 @@
+/* TeensyDmx - host build EEPROM, held in memory for the life of the process
+*/
+
+#ifndef TEENSYDMX_HOST_AVR_EEPROM_H
+#define TEENSYDMX_HOST_AVR_EEPROM_H
+
+#include <stddef.h>
+
+// The same size as a Teensy 3.2
+#define E2END 0x7FF
+
+void eeprom_read_block(void *dst, const void *src, size_t n);
+void eeprom_write_block(const void *src, void *dst, size_t n);
+
+#endif  // TEENSYDMX_HOST_AVR_EEPROM_H
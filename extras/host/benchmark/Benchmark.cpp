@@ -0,0 +1,363 @@
+/* TeensyDmx - host benchmarks for the receive path, RDM and discovery
+
+   Built by "make benchmark" in extras/host. Everything runs through the
+   unmodified state machine in TeensyDmx.cpp; the receive streams are fed
+   straight into the UART interrupt, discovery and RDM requests go over the
+   simulated line. Wall clock times are for this machine, virtual times are
+   what the line would take on a Teensy.
+*/
+
+// PlatformIO builds everything under the library, this is for the host only
+#ifndef TEENSYDUINO
+
+#include "TeensyDmx.h"
+#include "rdm.h"
+#include "SimBus.h"
+#include "SimResponder.h"
+
+#include <chrono>
+#include <memory>
+#include <random>
+#include <set>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+namespace {
+
+enum { RDM_HEADER_SIZE = 24 };
+enum { PARSER_UART = 1 };  // Serial2
+enum { PORT_PARSER_UART = 3 };  // Serial4
+enum { DEVICE_INFO_REQUESTS = 200 };
+// Give up on a discovery after this long on the line
+enum { DISCOVERY_TIMEOUT = 600000000 };
+enum { RDM_TIMEOUT = 1000000 };
+
+const int RESPONDER_COUNTS[] = {1, 10, 50, 100, 250, 500};
+
+byte controllerUid[] = {0x7f, 0xf0, 0x20, 0x12, 0x00, 0x00};
+byte parserUid[] = {0x7f, 0xf0, 0x20, 0x12, 0x00, 0x01};
+byte otherUid[] = {0x7f, 0xf0, 0x20, 0x12, 0x00, 0x02};
+
+bool discoveryDone = false;
+uint32_t discoveredCount = 0;
+
+bool rdmDone = false;
+CallbackStatus rdmStatus;
+
+void discoveryComplete(CallbackStatus status, byte *uids, uint32_t uidCount)
+{
+    (void) uids;
+    if (status == CallbackStatus::CB_RDM_CACHED) {
+        return;
+    }
+    discoveryDone = true;
+    discoveredCount = uidCount;
+}
+
+void rdmComplete(CallbackStatus status, RdmData *data)
+{
+    (void) data;
+    rdmDone = true;
+    rdmStatus = status;
+}
+
+struct RdmInit controllerInit {
+    controllerUid, 0x00000100, "Benchmark", "TeensyDmx", 1, "Controller",
+    E120_PRODUCT_CATEGORY_DIMMER_CS_LED, 1, 1, 0, 0,
+    &discoveryComplete, &rdmComplete, nullptr, nullptr
+};
+
+struct RdmInit parserInit {
+    parserUid, 0x00000100, "Benchmark", "TeensyDmx", 1, "Responder",
+    E120_PRODUCT_CATEGORY_DIMMER_CS_LED, 1, 1, 0, 0,
+    nullptr, nullptr, nullptr, nullptr
+};
+
+// The same responder again, for the TeensyDmxPort receiver
+struct RdmInit portParserInit = parserInit;
+
+TeensyDmx controller(Serial1, &controllerInit);
+TeensyDmx parser(Serial2, &parserInit);
+TeensyDmxPort<PORT_PARSER_UART> portParser(&portParserInit);
+
+uint64_t wallNanos()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void controllerLoop()
+{
+    controller.loop();
+}
+
+bool isDiscoveryDone()
+{
+    return discoveryDone;
+}
+
+bool isRdmDone()
+{
+    return rdmDone;
+}
+
+#ifdef TEENSYDMX_PROFILING
+// On the host the profile counts nanoseconds rather than cycles
+void printProfile(const char *title, const TeensyDmx& dmx)
+{
+    static const char *SITE_NAMES[PROFILE_SITE_COUNT] = {
+        "RX status", "RX error", "TX status", "loop()", "responder RDM", "controller RDM"
+    };
+    printf("%s profile\n", title);
+    printf("%-16s %10s %10s %10s %10s\n", "site", "count", "min ns", "mean ns", "max ns");
+    for (uint8_t i = 0; i < PROFILE_SITE_COUNT; ++i) {
+        ProfileStats stats;
+        if (dmx.getProfileStats(static_cast<ProfileSite>(i), stats) && stats.count > 0) {
+            printf("%-16s %10u %10u %10.1f %10u\n", SITE_NAMES[i], stats.count, stats.min,
+                   static_cast<double>(stats.total) / stats.count, stats.max);
+        }
+    }
+    printf("\n");
+}
+#endif
+
+// A break followed by a frame, as the receiver sees it
+struct Stream
+{
+    const char *name;
+    std::vector<byte> frame;
+    uint32_t repeat;
+    // Receive window, the whole buffer if windowLength is 0
+    uint16_t windowStart;
+    uint16_t windowLength;
+};
+
+std::vector<byte> dmxFrame(uint16_t slots)
+{
+    std::vector<byte> frame(slots + 1);
+    frame[0] = 0;
+    for (uint16_t i = 1; i <= slots; ++i) {
+        frame[i] = i & 0xff;
+    }
+    return frame;
+}
+
+std::vector<byte> rdmFrame(const byte *destination, byte cmdClass, uint16_t pid,
+                           const byte *data, byte length)
+{
+    std::vector<byte> frame(RDM_HEADER_SIZE + length + 2);
+    frame[0] = E120_SC_RDM;
+    frame[1] = E120_SC_SUB_MESSAGE;
+    frame[2] = RDM_HEADER_SIZE + length;
+    memcpy(&frame[3], destination, RDM_UID_LENGTH);
+    memcpy(&frame[9], controllerUid, RDM_UID_LENGTH);
+    frame[15] = 1;  // Transaction number
+    frame[16] = 1;  // Port ID
+    frame[20] = cmdClass;
+    frame[21] = pid >> 8;
+    frame[22] = pid & 0xff;
+    frame[23] = length;
+    if (length > 0) {
+        memcpy(&frame[RDM_HEADER_SIZE], data, length);
+    }
+    uint16_t checksum = 0;
+    for (byte i = 0; i < frame[2]; ++i) {
+        checksum += frame[i];
+    }
+    frame[frame[2]] = checksum >> 8;
+    frame[frame[2] + 1] = checksum & 0xff;
+    return frame;
+}
+
+// Feeds the stream to dmx through its UART interrupt, returning the wall
+// clock nanoseconds taken and the bytes received
+uint64_t receiveStream(TeensyDmx& dmx, uint8_t uart, const Stream& stream, uint64_t& bytes)
+{
+    SimBus& bus = SimBus::instance();
+    dmx.setMode(TeensyDmx::DMX_IN);
+    if (stream.windowLength > 0) {
+        dmx.setReceiveWindow(stream.windowStart, stream.windowLength);
+    } else {
+        dmx.clearReceiveWindow();
+    }
+    bytes = 0;
+    uint64_t start = wallNanos();
+    for (uint32_t n = 0; n < stream.repeat; ++n) {
+        bus.inject(uart, UART_S1_FE);
+        for (size_t i = 0; i < stream.frame.size(); ++i) {
+            bus.inject(uart, UART_S1_RDRF, stream.frame[i]);
+        }
+        dmx.loop();
+        bytes += stream.frame.size() + 1;
+    }
+    uint64_t elapsed = wallNanos() - start;
+    dmx.setMode(TeensyDmx::DMX_OFF);
+    return elapsed;
+}
+
+void runParserBenchmarks()
+{
+    printf("Receive path (break, frame and loop() through the UART interrupt),\n"
+           "TeensyDmx and then TeensyDmxPort<%d>\n", PORT_PARSER_UART);
+    printf("%-34s %8s %12s %12s %10s %10s\n", "stream", "frames", "bytes", "bytes/s",
+           "ns/byte", "Port ns/b");
+
+    const byte label[] = "Benchmark label";
+    std::vector<Stream> streams;
+    streams.push_back(Stream{"DMX, full universe", dmxFrame(DMX_UNIVERSE_SIZE), 2000});
+    streams.push_back(Stream{"DMX, full universe, 4 slot window",
+                             dmxFrame(DMX_UNIVERSE_SIZE), 2000, 100, 4});
+    streams.push_back(Stream{"DMX, 24 slots", dmxFrame(24), 20000});
+    streams.push_back(Stream{"RDM GET DEVICE_INFO, other device",
+                             rdmFrame(otherUid, E120_GET_COMMAND, E120_DEVICE_INFO,
+                                      nullptr, 0), 20000});
+    streams.push_back(Stream{"RDM SET DEVICE_LABEL, broadcast",
+                             rdmFrame(parser.RDM_BROADCAST_UID, E120_SET_COMMAND,
+                                      E120_DEVICE_LABEL, label, sizeof(label) - 1), 20000});
+    streams.push_back(Stream{"RDM GET DEVICE_INFO, with reply",
+                             rdmFrame(parserUid, E120_GET_COMMAND, E120_DEVICE_INFO,
+                                      nullptr, 0), 2000});
+
+    for (size_t s = 0; s < streams.size(); ++s) {
+        const Stream& stream = streams[s];
+        uint64_t bytes;
+        uint64_t elapsed = receiveStream(parser, PARSER_UART, stream, bytes);
+        uint64_t portElapsed = receiveStream(portParser, PORT_PARSER_UART, stream, bytes);
+        printf("%-34s %8u %12llu %12.0f %10.2f %10.2f\n", stream.name, stream.repeat,
+               static_cast<unsigned long long>(bytes), bytes * 1e9 / elapsed,
+               static_cast<double>(elapsed) / bytes,
+               static_cast<double>(portElapsed) / bytes);
+    }
+    printf("\n");
+#ifdef TEENSYDMX_PROFILING
+    printProfile("Receive path", parser);
+    printProfile("TeensyDmxPort receive path", portParser);
+#endif
+}
+
+void runDiscoveryBenchmark(SimBus::CollisionModel model, bool decoding)
+{
+    static const char *MODEL_NAMES[] = {"AND", "OR", "garbled"};
+    char title[80];
+    snprintf(title, sizeof(title), "Discovery, %s collisions, wired-OR decoding %s",
+             MODEL_NAMES[model], decoding ? "on" : "off");
+    printf("Full discovery with DMX output running, %s collisions, wired-OR decoding %s\n",
+           MODEL_NAMES[model], decoding ? "on" : "off");
+    printf("%10s %8s %8s %10s %8s %12s %10s\n", "responders", "found", "DUBs",
+           "collisions", "decoded", "virtual ms", "wall ms");
+
+    SimBus& bus = SimBus::instance();
+    bus.setCollisionModel(model);
+    controller.setRDMWiredOrDecoding(decoding);
+    controller.setMode(TeensyDmx::DMX_OUT);
+    controller.clearProfileStats();
+    // The same responders for every model
+    std::mt19937_64 random(1);
+    for (size_t r = 0; r < sizeof(RESPONDER_COUNTS) / sizeof(RESPONDER_COUNTS[0]); ++r) {
+        // A few manufacturers with random device IDs, the same every run
+        std::set<uint64_t> uids;
+        while (uids.size() < static_cast<size_t>(RESPONDER_COUNTS[r])) {
+            uint64_t manufacturer = 0x7a70 + (random() % 4);
+            uids.insert((manufacturer << 32) | (random() & 0xffffffff));
+        }
+        std::vector<std::unique_ptr<SimResponder>> responders;
+        for (std::set<uint64_t>::const_iterator i = uids.begin(); i != uids.end(); ++i) {
+            responders.push_back(std::unique_ptr<SimResponder>(new SimResponder(*i)));
+            bus.addResponder(*responders.back());
+        }
+
+        discoveryDone = false;
+        uint64_t virtualStart = bus.now();
+        uint64_t wallStart = wallNanos();
+        controller.doRDMDiscovery();
+        bus.run(DISCOVERY_TIMEOUT, &controllerLoop, 10, &isDiscoveryDone);
+        uint64_t wallElapsed = wallNanos() - wallStart;
+
+        if (!discoveryDone) {
+            printf("%10d timed out\n", RESPONDER_COUNTS[r]);
+        } else {
+            const RdmDiscoveryStats& discoveryStats = controller.getRDMDiscoveryStats();
+            printf("%10d %8u %8u %10u %8u %12.1f %10.1f\n", RESPONDER_COUNTS[r],
+                   discoveredCount, discoveryStats.dubCount, discoveryStats.collisionCount,
+                   discoveryStats.decodedCount, (bus.now() - virtualStart) / 1e3,
+                   wallElapsed / 1e6);
+        }
+        for (size_t i = 0; i < responders.size(); ++i) {
+            bus.removeResponder(*responders[i]);
+        }
+    }
+    printf("\n");
+#ifdef TEENSYDMX_PROFILING
+    printProfile(title, controller);
+#else
+    (void) title;
+#endif
+}
+
+void runDiscoveryBenchmarks()
+{
+    static const SimBus::CollisionModel MODELS[] = {
+        SimBus::COLLISION_AND, SimBus::COLLISION_OR, SimBus::COLLISION_GARBLED
+    };
+    for (size_t m = 0; m < sizeof(MODELS) / sizeof(MODELS[0]); ++m) {
+        runDiscoveryBenchmark(MODELS[m], true);
+        runDiscoveryBenchmark(MODELS[m], false);
+    }
+    // Back to the defaults for the rest
+    SimBus::instance().setCollisionModel(SimBus::COLLISION_AND);
+    controller.setRDMWiredOrDecoding(false);
+}
+
+void runRdmLatencyBenchmark()
+{
+    printf("RDM GET DEVICE_INFO round trips with DMX output running\n");
+    printf("%8s %8s %14s %14s %14s %12s\n", "requests", "acked", "mean virt us",
+           "min virt us", "max virt us", "wall us/req");
+
+    SimBus& bus = SimBus::instance();
+    SimResponder responder(0x7a7000000001ULL);
+    bus.addResponder(responder);
+    byte uid[RDM_UID_LENGTH];
+    memcpy(uid, responder.uid(), RDM_UID_LENGTH);
+    controller.setMode(TeensyDmx::DMX_OUT);
+
+    uint32_t acked = 0;
+    uint64_t total = 0;
+    uint64_t lowest = UINT64_MAX;
+    uint64_t highest = 0;
+    uint64_t wallStart = wallNanos();
+    for (uint32_t n = 0; n < DEVICE_INFO_REQUESTS; ++n) {
+        rdmDone = false;
+        // Time the line, not the response cache
+        controller.clearRDMCache();
+        uint64_t start = bus.now();
+        controller.sendRDMGetDeviceInfo(uid);
+        bus.run(RDM_TIMEOUT, &controllerLoop, 10, &isRdmDone);
+        uint64_t latency = bus.now() - start;
+        if (rdmDone && rdmStatus == CallbackStatus::CB_SUCCESS) {
+            ++acked;
+        }
+        total += latency;
+        lowest = std::min(lowest, latency);
+        highest = std::max(highest, latency);
+    }
+    uint64_t wallElapsed = wallNanos() - wallStart;
+    printf("%8u %8u %14.1f %14llu %14llu %12.1f\n\n", DEVICE_INFO_REQUESTS, acked,
+           static_cast<double>(total) / DEVICE_INFO_REQUESTS,
+           static_cast<unsigned long long>(lowest), static_cast<unsigned long long>(highest),
+           wallElapsed / 1e3 / DEVICE_INFO_REQUESTS);
+    bus.removeResponder(responder);
+}
+
+}  // anon namespace
+
+int main()
+{
+    runParserBenchmarks();
+    runDiscoveryBenchmarks();
+    runRdmLatencyBenchmark();
+    return 0;
+}
+
+#endif  // TEENSYDUINO
@@ -0,0 +1,20 @@
+/* TeensyDmx - prints the RAM taken by one TeensyDmx for the size report
+
+   Built once for each TEENSYDMX_FEATURES profile by "make size-report" in
+   extras/host.
+*/
+
+// PlatformIO builds everything under the library, this is for the host only
+#ifndef TEENSYDUINO
+
+#include "TeensyDmx.h"
+
+#include <stdio.h>
+
+int main()
+{
+    printf("%u\n", static_cast<unsigned>(sizeof(TeensyDmx)));
+    return 0;
+}
+
+#endif  // TEENSYDUINO